@@ -0,0 +1,721 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAXLIST 16
+#define MAXEXTRA 16
+#define MAXARGS (16 + MAXEXTRA)
+#define DEFPORT 17117
+#define DEFSECONDS 3
+#define STARTTIMEOUT 10
+#define DRAINTIMEOUT 10
+#define IOCHUNK (64*1024)
+#define DIRSZ 80
+#define PATHSZ 108
+
+#define STR(m) XSTR(m)
+#define XSTR(m) #m
+
+typedef struct Echo
+{
+    int fd;
+    size_t len;
+    size_t pos;
+    uint8_t buf[IOCHUNK];
+} Echo;
+
+typedef struct Channel
+{
+    int fd;
+    size_t sent;
+    size_t got;
+    uint64_t start;
+} Channel;
+
+typedef struct Result
+{
+    double seconds;
+    double cpu;
+    unsigned long long requests;
+    unsigned long long errors;
+    uint32_t *samples;
+    size_t nsamples;
+    size_t samplescap;
+} Result;
+
+typedef struct Bench
+{
+    const char *remusockd;
+    char *extra[MAXEXTRA];
+    int nextra;
+    int port;
+    int seconds;
+    int plain;
+    int tls;
+    int channels[MAXLIST];
+    int nchannels;
+    long sizes[MAXLIST];
+    int nsizes;
+    int listenfd;
+    Echo **echoes;
+    size_t nechoes;
+    size_t echoescap;
+    pid_t server;
+    pid_t client;
+    char dir[DIRSZ];
+    char echosock[PATHSZ];
+    char frontsock[PATHSZ];
+    char serverpid[PATHSZ];
+    char clientpid[PATHSZ];
+    char cert[PATHSZ];
+    char key[PATHSZ];
+    char log[PATHSZ];
+} Bench;
+
+static void usage(const char *prgname);
+static int parselist(const char *str, long *vals, int *n, long max);
+static uint64_t now(void);
+static double childcpu(void);
+static void *xrealloc(void *ptr, size_t sz);
+static int nonblock(int fd);
+static int listenunix(const char *path);
+static int connectunix(const char *path);
+static pid_t spawn(Bench *self, char **argv);
+static int runcmd(Bench *self, char **argv);
+static int startdaemons(Bench *self, int tls);
+static void stopdaemons(Bench *self);
+static void acceptechoes(Bench *self);
+static int handleecho(Echo *echo, short revents);
+static void closeecho(Bench *self, size_t idx);
+static void addsample(Result *result, uint64_t usecs);
+static int handlechannel(Channel *chan, short revents, const uint8_t *msg,
+	size_t size, uint64_t deadline, Result *result);
+static int runload(Bench *self, int nchan, size_t size, int seconds,
+	int timeout, Result *result);
+static int cmpsample(const void *a, const void *b);
+static uint32_t percentile(const Result *result, double p);
+static int waitready(Bench *self);
+static void report(int tls, int nchan, size_t size, Result *result);
+static void cleanup(Bench *self);
+
+static void usage(const char *prgname)
+{
+    fprintf(stderr, "Usage: %s [-PS] [-c channels[,...]] [-d remusockd]\n"
+	    "\t\t[-p port] [-s bytes[,...]] [-t seconds] [-x arg ...]\n",
+	    prgname);
+    fputs("\n\t-P             only run without TLS\n"
+	    "\t-S             only run with TLS\n"
+	    "\t-c channels    numbers of concurrent socket connections,\n"
+	    "\t               defaults to 1,10,100,1000\n"
+	    "\t-d remusockd   the remusockd binary to benchmark,\n"
+	    "\t               defaults to remusockd from PATH\n"
+	    "\t-p port        TCP port on loopback to use,\n"
+	    "\t               defaults to " STR(DEFPORT) "\n"
+	    "\t-s bytes       message sizes, defaults to 64,4096,65536\n"
+	    "\t-t seconds     duration of every run, defaults to "
+	    STR(DEFSECONDS) "\n"
+	    "\t-x arg         pass `arg' to both remusockd instances,\n"
+	    "\t               can be given multiple times\n"
+	    "\n"
+	    "Two remusockd instances are started on loopback, tunnelling to\n"
+	    "an echo server. For every combination of TLS, channels and\n"
+	    "message size, each channel sends a message and waits for the\n"
+	    "complete echo before sending the next one. One line of JSON\n"
+	    "per run is written to stdout, mb_per_s counts message bytes\n"
+	    "in one direction. The instances are restarted for every run,\n"
+	    "cpu_s is the CPU time both of them used, cpu_s_per_gb relates\n"
+	    "it to the message bytes counted like for mb_per_s.\n\n",
+	    stderr);
+}
+
+static int parselist(const char *str, long *vals, int *n, long max)
+{
+    *n = 0;
+    while (*str)
+    {
+	char *endp;
+	errno = 0;
+	long val = strtol(str, &endp, 10);
+	if (errno == ERANGE || endp == str || val < 1 || val > max
+		|| *n == MAXLIST) return -1;
+	vals[(*n)++] = val;
+	if (!*endp) break;
+	if (*endp != ',') return -1;
+	str = endp + 1;
+    }
+    return *n ? 0 : -1;
+}
+
+static uint64_t now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000U + ts.tv_nsec / 1000;
+}
+
+static double childcpu(void)
+{
+    struct rusage ru;
+    if (getrusage(RUSAGE_CHILDREN, &ru) < 0) return 0;
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+	+ ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static void *xrealloc(void *ptr, size_t sz)
+{
+    void *p = realloc(ptr, sz);
+    if (!p)
+    {
+	fputs("out of memory\n", stderr);
+	abort();
+    }
+    return p;
+}
+
+static int nonblock(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static int listenunix(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof addr.sun_path, "%s", path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0
+	    || listen(fd, SOMAXCONN) < 0 || nonblock(fd) < 0)
+    {
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+static int connectunix(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof addr.sun_path, "%s", path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    /* connect blocking, so a full backlog doesn't count as an error */
+    if (connect(fd, (struct sockaddr *)&addr, sizeof addr) < 0
+	    || nonblock(fd) < 0)
+    {
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+static pid_t spawn(Bench *self, char **argv)
+{
+    pid_t pid = fork();
+    if (pid) return pid;
+
+    int fd = open(self->log, O_WRONLY|O_CREAT|O_APPEND, 0600);
+    if (fd >= 0)
+    {
+	dup2(fd, STDOUT_FILENO);
+	dup2(fd, STDERR_FILENO);
+	close(fd);
+    }
+    signal(SIGPIPE, SIG_DFL);
+    execvp(argv[0], argv);
+    _exit(127);
+}
+
+static int runcmd(Bench *self, char **argv)
+{
+    int status;
+    pid_t pid = spawn(self, argv);
+    if (pid < 0 || waitpid(pid, &status, 0) < 0) return -1;
+    return WIFEXITED(status) && !WEXITSTATUS(status) ? 0 : -1;
+}
+
+static int startdaemons(Bench *self, int tls)
+{
+    char portstr[8];
+    snprintf(portstr, sizeof portstr, "%d", self->port);
+
+    char *argv[MAXARGS];
+    int argc = 0;
+    argv[argc++] = (char *)self->remusockd;
+    argv[argc++] = "-f";
+    argv[argc++] = "-c";
+    argv[argc++] = "-b";
+    argv[argc++] = "127.0.0.1";
+    argv[argc++] = "-p";
+    argv[argc++] = self->serverpid;
+    for (int i = 0; i < self->nextra; ++i) argv[argc++] = self->extra[i];
+    argv[argc++] = self->echosock;
+    argv[argc++] = portstr;
+    if (tls)
+    {
+	argv[argc++] = self->cert;
+	argv[argc++] = self->key;
+    }
+    argv[argc] = 0;
+    if ((self->server = spawn(self, argv)) < 0) return -1;
+
+    argc = 0;
+    argv[argc++] = (char *)self->remusockd;
+    argv[argc++] = "-f";
+    argv[argc++] = "-n";
+    argv[argc++] = "-r";
+    argv[argc++] = "127.0.0.1";
+    argv[argc++] = "-p";
+    argv[argc++] = self->clientpid;
+    if (tls) argv[argc++] = "-V";
+    for (int i = 0; i < self->nextra; ++i) argv[argc++] = self->extra[i];
+    argv[argc++] = self->frontsock;
+    argv[argc++] = portstr;
+    argv[argc] = 0;
+    if ((self->client = spawn(self, argv)) < 0) return -1;
+
+    return waitready(self);
+}
+
+static void stopdaemons(Bench *self)
+{
+    if (self->client > 0)
+    {
+	kill(self->client, SIGTERM);
+	waitpid(self->client, 0, 0);
+	self->client = 0;
+    }
+    if (self->server > 0)
+    {
+	kill(self->server, SIGTERM);
+	waitpid(self->server, 0, 0);
+	self->server = 0;
+    }
+    while (self->nechoes) closeecho(self, 0);
+    unlink(self->frontsock);
+}
+
+static void acceptechoes(Bench *self)
+{
+    int fd;
+    while ((fd = accept(self->listenfd, 0, 0)) >= 0)
+    {
+	if (nonblock(fd) < 0)
+	{
+	    close(fd);
+	    continue;
+	}
+	if (self->nechoes == self->echoescap)
+	{
+	    self->echoescap = self->echoescap ? 2 * self->echoescap : 64;
+	    self->echoes = xrealloc(self->echoes,
+		    self->echoescap * sizeof *self->echoes);
+	}
+	Echo *echo = xrealloc(0, sizeof *echo);
+	echo->fd = fd;
+	echo->len = 0;
+	echo->pos = 0;
+	self->echoes[self->nechoes++] = echo;
+    }
+}
+
+static int handleecho(Echo *echo, short revents)
+{
+    if (!echo->len)
+    {
+	if (!(revents & (POLLIN|POLLHUP|POLLERR))) return 0;
+	ssize_t rc = read(echo->fd, echo->buf, sizeof echo->buf);
+	if (rc < 0 && (errno == EAGAIN || errno == EINTR)) return 0;
+	if (rc <= 0) return -1;
+	echo->len = rc;
+	echo->pos = 0;
+    }
+    ssize_t rc = write(echo->fd, echo->buf + echo->pos,
+	    echo->len - echo->pos);
+    if (rc < 0 && (errno == EAGAIN || errno == EINTR)) return 0;
+    if (rc < 0) return -1;
+    echo->pos += rc;
+    if (echo->pos == echo->len) echo->len = 0;
+    return 0;
+}
+
+static void closeecho(Bench *self, size_t idx)
+{
+    close(self->echoes[idx]->fd);
+    free(self->echoes[idx]);
+    self->echoes[idx] = self->echoes[--self->nechoes];
+}
+
+static void addsample(Result *result, uint64_t usecs)
+{
+    if (result->nsamples == result->samplescap)
+    {
+	result->samplescap = result->samplescap ?
+	    2 * result->samplescap : 1024;
+	result->samples = xrealloc(result->samples,
+		result->samplescap * sizeof *result->samples);
+    }
+    result->samples[result->nsamples++] = usecs > UINT32_MAX ?
+	UINT32_MAX : usecs;
+}
+
+static int handlechannel(Channel *chan, short revents, const uint8_t *msg,
+	size_t size, uint64_t deadline, Result *result)
+{
+    static uint8_t discard[IOCHUNK];
+
+    if (revents & (POLLIN|POLLHUP|POLLERR))
+    {
+	ssize_t rc = read(chan->fd, discard, sizeof discard);
+	if (rc < 0 && errno != EAGAIN && errno != EINTR) return -1;
+	if (!rc || chan->got + rc > size) return -1;
+	if (rc > 0) chan->got += rc;
+    }
+    if ((revents & POLLOUT) && chan->sent < size)
+    {
+	if (!chan->sent) chan->start = now();
+	ssize_t rc = write(chan->fd, msg + chan->sent, size - chan->sent);
+	if (rc < 0 && errno != EAGAIN && errno != EINTR) return -1;
+	if (rc > 0) chan->sent += rc;
+    }
+    if (chan->got == size)
+    {
+	uint64_t t = now();
+	addsample(result, t - chan->start);
+	++result->requests;
+	if (t >= deadline) return 1;
+	chan->sent = 0;
+	chan->got = 0;
+    }
+    return 0;
+}
+
+static int runload(Bench *self, int nchan, size_t size, int seconds,
+	int timeout, Result *result)
+{
+    memset(result, 0, sizeof *result);
+    uint8_t *msg = xrealloc(0, size);
+    for (size_t i = 0; i < size; ++i) msg[i] = i * 7;
+    Channel *chans = xrealloc(0, nchan * sizeof *chans);
+    struct pollfd *pfd = 0;
+    size_t pfdcap = 0;
+
+    int active = 0;
+    uint64_t start = now();
+    for (int i = 0; i < nchan; ++i)
+    {
+	chans[i].fd = connectunix(self->frontsock);
+	chans[i].sent = 0;
+	chans[i].got = 0;
+	chans[i].start = 0;
+	if (chans[i].fd < 0) ++result->errors;
+	else ++active;
+    }
+    uint64_t deadline = start + seconds * 1000000ULL;
+    uint64_t giveup = deadline + timeout * 1000000ULL;
+
+    while (active)
+    {
+	size_t need = 1 + self->nechoes + nchan;
+	if (need > pfdcap)
+	{
+	    pfdcap = need;
+	    pfd = xrealloc(pfd, pfdcap * sizeof *pfd);
+	}
+	size_t n = 0;
+	pfd[n].fd = self->listenfd;
+	pfd[n++].events = POLLIN;
+	for (size_t i = 0; i < self->nechoes; ++i)
+	{
+	    pfd[n].fd = self->echoes[i]->fd;
+	    pfd[n++].events = self->echoes[i]->len ? POLLOUT : POLLIN;
+	}
+	for (int i = 0; i < nchan; ++i)
+	{
+	    pfd[n].fd = chans[i].fd;
+	    pfd[n++].events = chans[i].sent < size ? POLLIN|POLLOUT : POLLIN;
+	}
+
+	uint64_t t = now();
+	if (t >= giveup) break;
+	int rc = poll(pfd, n, (giveup - t) / 1000 + 1);
+	if (rc < 0 && errno != EINTR) break;
+	if (rc <= 0) continue;
+
+	size_t nechoes = self->nechoes;
+	for (size_t i = nechoes; i > 0; --i)
+	{
+	    if (pfd[i].revents && handleecho(self->echoes[i-1],
+			pfd[i].revents) < 0) closeecho(self, i-1);
+	}
+	if (pfd[0].revents) acceptechoes(self);
+	for (int i = 0; i < nchan; ++i)
+	{
+	    short revents = pfd[1 + nechoes + i].revents;
+	    if (chans[i].fd < 0 || !revents) continue;
+	    rc = handlechannel(chans + i, revents, msg, size, deadline,
+		    result);
+	    if (rc)
+	    {
+		if (rc < 0) ++result->errors;
+		close(chans[i].fd);
+		chans[i].fd = -1;
+		--active;
+	    }
+	}
+    }
+
+    result->seconds = (now() - start) / 1e6;
+    if (result->seconds > seconds && seconds) result->seconds = seconds;
+    for (int i = 0; i < nchan; ++i)
+    {
+	if (chans[i].fd < 0) continue;
+	++result->errors;
+	close(chans[i].fd);
+    }
+    free(pfd);
+    free(chans);
+    free(msg);
+    return result->requests ? 0 : -1;
+}
+
+static int cmpsample(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint32_t percentile(const Result *result, double p)
+{
+    if (!result->nsamples) return 0;
+    size_t rank = p / 100.0 * result->nsamples;
+    if (rank >= result->nsamples) rank = result->nsamples - 1;
+    return result->samples[rank];
+}
+
+static int waitready(Bench *self)
+{
+    Result result;
+    uint64_t giveup = now() + STARTTIMEOUT * 1000000ULL;
+    int fd;
+    while ((fd = connectunix(self->frontsock)) < 0)
+    {
+	if (now() >= giveup) return -1;
+	nanosleep(&(struct timespec){ 0, 100000000 }, 0);
+    }
+    close(fd);
+    int rc = runload(self, 1, 1, 0, STARTTIMEOUT, &result);
+    free(result.samples);
+    return rc;
+}
+
+static void report(int tls, int nchan, size_t size, Result *result)
+{
+    qsort(result->samples, result->nsamples, sizeof *result->samples,
+	    cmpsample);
+    double secs = result->seconds > 0 ? result->seconds : 1;
+    double gb = result->requests * size / 1e9;
+    printf("{\"tls\":%s,\"channels\":%d,\"size\":%zu,\"seconds\":%.3f,"
+	    "\"requests\":%llu,\"errors\":%llu,\"requests_per_s\":%.1f,"
+	    "\"mb_per_s\":%.3f,\"cpu_s\":%.3f,\"cpu_s_per_gb\":%.2f,"
+	    "\"p50_us\":%u,\"p99_us\":%u,\"p999_us\":%u,\"max_us\":%u}\n",
+	    tls ? "true" : "false", nchan, size, result->seconds,
+	    result->requests, result->errors, result->requests / secs,
+	    result->requests * size / secs / 1e6, result->cpu,
+	    gb > 0 ? result->cpu / gb : 0.0,
+	    (unsigned)percentile(result, 50.0),
+	    (unsigned)percentile(result, 99.0),
+	    (unsigned)percentile(result, 99.9),
+	    (unsigned)percentile(result, 100.0));
+    fflush(stdout);
+}
+
+static void cleanup(Bench *self)
+{
+    stopdaemons(self);
+    if (self->listenfd >= 0) close(self->listenfd);
+    free(self->echoes);
+    unlink(self->echosock);
+    unlink(self->frontsock);
+    unlink(self->serverpid);
+    unlink(self->clientpid);
+    unlink(self->cert);
+    unlink(self->key);
+    rmdir(self->dir);
+}
+
+int main(int argc, char **argv)
+{
+    Bench bench;
+    long vals[MAXLIST];
+    int n;
+    int opt;
+
+    memset(&bench, 0, sizeof bench);
+    bench.remusockd = "remusockd";
+    bench.port = DEFPORT;
+    bench.seconds = DEFSECONDS;
+    bench.plain = 1;
+    bench.tls = 1;
+    bench.listenfd = -1;
+    bench.channels[0] = 1;
+    bench.channels[1] = 10;
+    bench.channels[2] = 100;
+    bench.channels[3] = 1000;
+    bench.nchannels = 4;
+    bench.sizes[0] = 64;
+    bench.sizes[1] = 4096;
+    bench.sizes[2] = 65536;
+    bench.nsizes = 3;
+
+    const char *prgname = argc > 0 ? argv[0] : "remusock-bench";
+    while ((opt = getopt(argc, argv, "PSc:d:p:s:t:x:")) != -1)
+    {
+	switch (opt)
+	{
+	    case 'P':
+		bench.tls = 0;
+		break;
+	    case 'S':
+		bench.plain = 0;
+		break;
+	    case 'c':
+		if (parselist(optarg, vals, &n, 100000) < 0) goto usage;
+		for (int i = 0; i < n; ++i) bench.channels[i] = vals[i];
+		bench.nchannels = n;
+		break;
+	    case 'd':
+		bench.remusockd = optarg;
+		break;
+	    case 'p':
+		if (parselist(optarg, vals, &n, 65535) < 0 || n != 1)
+		{
+		    goto usage;
+		}
+		bench.port = vals[0];
+		break;
+	    case 's':
+		if (parselist(optarg, vals, &n, 64*1024*1024) < 0) goto usage;
+		memcpy(bench.sizes, vals, n * sizeof *vals);
+		bench.nsizes = n;
+		break;
+	    case 't':
+		if (parselist(optarg, vals, &n, 3600) < 0 || n != 1)
+		{
+		    goto usage;
+		}
+		bench.seconds = vals[0];
+		break;
+	    case 'x':
+		if (bench.nextra == MAXEXTRA) goto usage;
+		bench.extra[bench.nextra++] = optarg;
+		break;
+	    default:
+		goto usage;
+	}
+    }
+    if (optind != argc || (!bench.plain && !bench.tls)) goto usage;
+
+    /* every channel needs a descriptor for each end here */
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    const char *tmp = getenv("TMPDIR");
+    if (!tmp) tmp = "/tmp";
+    if (snprintf(bench.dir, DIRSZ, "%s/remusock-bench.XXXXXX", tmp)
+	    >= DIRSZ || !mkdtemp(bench.dir))
+    {
+	perror("mkdtemp");
+	return EXIT_FAILURE;
+    }
+    snprintf(bench.echosock, PATHSZ, "%s/echo.sock", bench.dir);
+    snprintf(bench.frontsock, PATHSZ, "%s/front.sock", bench.dir);
+    snprintf(bench.serverpid, PATHSZ, "%s/server.pid", bench.dir);
+    snprintf(bench.clientpid, PATHSZ, "%s/client.pid", bench.dir);
+    snprintf(bench.cert, PATHSZ, "%s/cert.pem", bench.dir);
+    snprintf(bench.key, PATHSZ, "%s/key.pem", bench.dir);
+    snprintf(bench.log, PATHSZ, "remusock-bench.log");
+
+    int rc = EXIT_FAILURE;
+    if ((bench.listenfd = listenunix(bench.echosock)) < 0)
+    {
+	perror("echo server");
+	goto done;
+    }
+    if (bench.tls)
+    {
+	char *openssl[] = { "openssl", "req", "-x509", "-newkey", "rsa:2048",
+	    "-nodes", "-days", "1", "-subj", "/CN=localhost",
+	    "-keyout", bench.key, "-out", bench.cert, 0 };
+	if (runcmd(&bench, openssl) < 0)
+	{
+	    fputs("failed to create a certificate with openssl, "
+		    "see remusock-bench.log\n", stderr);
+	    goto done;
+	}
+    }
+
+    for (int tls = !bench.plain; tls <= bench.tls; ++tls)
+    {
+	for (int c = 0; c < bench.nchannels; ++c)
+	{
+	    for (int s = 0; s < bench.nsizes; ++s)
+	    {
+		/* fresh instances, so their CPU time is known once they
+		 * were waited for */
+		double cpu = childcpu();
+		if (startdaemons(&bench, tls) < 0)
+		{
+		    fputs("remusockd didn't come up, "
+			    "see remusock-bench.log\n", stderr);
+		    goto done;
+		}
+		Result result;
+		fprintf(stderr, "%s, %d channels, %ld bytes ...\n",
+			tls ? "TLS" : "plain", bench.channels[c],
+			bench.sizes[s]);
+		runload(&bench, bench.channels[c], bench.sizes[s],
+			bench.seconds, DRAINTIMEOUT, &result);
+		stopdaemons(&bench);
+		result.cpu = childcpu() - cpu;
+		report(tls, bench.channels[c], bench.sizes[s], &result);
+		free(result.samples);
+	    }
+	}
+    }
+    rc = EXIT_SUCCESS;
+
+done:
+    cleanup(&bench);
+    return rc;
+
+usage:
+    usage(prgname);
+    return EXIT_FAILURE;
+}
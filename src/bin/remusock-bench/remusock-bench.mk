@@ -0,0 +1,3 @@
+remusock-bench_MODULES:=	bench
+
+$(call binrules, remusock-bench)
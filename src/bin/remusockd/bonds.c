@@ -0,0 +1,129 @@
+#include "bonds.h"
+
+#include <poser/core.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct Bond
+{
+    Bonds *bonds;
+    Protocol *members[BOND_MAXMEMBERS];
+    unsigned count;
+    uint8_t id[BOND_IDSZ];
+};
+
+struct Bonds
+{
+    Bond **bonds;
+    size_t size;
+    size_t count;
+};
+
+Bonds *Bonds_create(void)
+{
+    Bonds *self = PSC_malloc(sizeof *self);
+    self->bonds = 0;
+    self->size = 0;
+    self->count = 0;
+    return self;
+}
+
+void Bonds_newId(uint8_t *id)
+{
+    int ok = 0;
+    FILE *urandom = fopen("/dev/urandom", "rb");
+    if (urandom)
+    {
+	ok = fread(id, BOND_IDSZ, 1, urandom) == 1;
+	fclose(urandom);
+    }
+    if (!ok)
+    {
+	PSC_Log_msg(PSC_L_WARNING,
+		"Bonds: can't read /dev/urandom, bond id is guessable");
+	uint64_t seed = (uint64_t)time(0) << 32 ^ (uint64_t)clock();
+	for (size_t i = 0; i < BOND_IDSZ; ++i)
+	{
+	    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+	    id[i] = seed >> 56;
+	}
+    }
+}
+
+Bond *Bonds_join(Bonds *self, const uint8_t *id, unsigned index,
+	Protocol *proto)
+{
+    if (index >= BOND_MAXMEMBERS) return 0;
+
+    Bond *bond = 0;
+    for (size_t i = 0; i < self->count; ++i)
+    {
+	if (!memcmp(self->bonds[i]->id, id, BOND_IDSZ))
+	{
+	    bond = self->bonds[i];
+	    break;
+	}
+    }
+    if (!bond)
+    {
+	if (self->count == self->size)
+	{
+	    self->size = self->size ? 2 * self->size : 4;
+	    self->bonds = PSC_realloc(self->bonds,
+		    self->size * sizeof *self->bonds);
+	}
+	bond = PSC_malloc(sizeof *bond);
+	memset(bond, 0, sizeof *bond);
+	bond->bonds = self;
+	memcpy(bond->id, id, BOND_IDSZ);
+	self->bonds[self->count++] = bond;
+    }
+    if (bond->members[index]) return 0;
+    bond->members[index] = proto;
+    ++bond->count;
+    return bond;
+}
+
+void Bonds_destroy(Bonds *self)
+{
+    if (!self) return;
+    for (size_t i = 0; i < self->count; ++i)
+    {
+	/* members still there are destroyed with their TCP connections */
+	self->bonds[i]->bonds = 0;
+    }
+    free(self->bonds);
+    free(self);
+}
+
+void Bond_leave(Bond *self, Protocol *proto)
+{
+    for (unsigned i = 0; i < BOND_MAXMEMBERS; ++i)
+    {
+	if (self->members[i] == proto)
+	{
+	    self->members[i] = 0;
+	    --self->count;
+	    break;
+	}
+    }
+    if (self->count) return;
+
+    Bonds *bonds = self->bonds;
+    if (bonds) for (size_t i = 0; i < bonds->count; ++i)
+    {
+	if (bonds->bonds[i] == self)
+	{
+	    bonds->bonds[i] = bonds->bonds[--bonds->count];
+	    break;
+	}
+    }
+    free(self);
+}
+
+Protocol *Bond_member(const Bond *self, unsigned index)
+{
+    return index < BOND_MAXMEMBERS ? self->members[index] : 0;
+}
@@ -0,0 +1,33 @@
+#ifndef REMUSOCKD_BONDS_H
+#define REMUSOCKD_BONDS_H
+
+#include <stdint.h>
+
+#define BOND_IDSZ 16
+#define BOND_MAXMEMBERS 16
+
+typedef struct Bonds Bonds;
+typedef struct Bond Bond;
+
+typedef struct Protocol Protocol;
+
+/* Groups the TCP connections of one peer that share the data of their
+ * socket connections, owned by a TcpServer or TcpClient. A bond is
+ * identified by a random id chosen by the client, and each of its
+ * members by the index of the client's tunnel. */
+Bonds *Bonds_create(void);
+
+/* a new random id, anyone knowing it can join the bond */
+void Bonds_newId(uint8_t *id);
+
+/* returns 0 if the index is out of range or already taken, a member is
+ * only replaced after it left */
+Bond *Bonds_join(Bonds *self, const uint8_t *id, unsigned index,
+	Protocol *proto);
+void Bonds_destroy(Bonds *self);
+
+/* the bond is destroyed when its last member left */
+void Bond_leave(Bond *self, Protocol *proto);
+Protocol *Bond_member(const Bond *self, unsigned index);
+
+#endif
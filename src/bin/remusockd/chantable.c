@@ -0,0 +1,146 @@
+#include "chantable.h"
+
+#include <poser/core.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PAGEBITS 8
+#define PAGESIZE (1U << PAGEBITS)
+#define PAGEMASK (PAGESIZE - 1)
+
+/* ids are only reused after this many other ids were released, so frames
+ * still in flight for a closed channel can't reach a new one */
+#define REUSEDELAY 1024
+
+struct ChanTable
+{
+    void ***pages;
+    uint32_t *freeids;
+    size_t npages;
+    size_t count;
+    size_t freesize;
+    size_t freefirst;
+    size_t freecount;
+    uint32_t nextid;
+};
+
+ChanTable *ChanTable_create(void)
+{
+    ChanTable *self = PSC_malloc(sizeof *self);
+    memset(self, 0, sizeof *self);
+    self->nextid = 1;
+    return self;
+}
+
+void *ChanTable_get(const ChanTable *self, uint32_t id)
+{
+    size_t page = id >> PAGEBITS;
+    if (page >= self->npages || !self->pages[page]) return 0;
+    return self->pages[page][id & PAGEMASK];
+}
+
+int ChanTable_set(ChanTable *self, uint32_t id, void *obj)
+{
+    if (id > CHANTABLE_MAXID) return -1;
+    size_t page = id >> PAGEBITS;
+    if (page >= self->npages)
+    {
+	size_t npages = self->npages ? self->npages : 1;
+	while (npages <= page) npages *= 2;
+	self->pages = PSC_realloc(self->pages, npages * sizeof *self->pages);
+	memset(self->pages + self->npages, 0,
+		(npages - self->npages) * sizeof *self->pages);
+	self->npages = npages;
+    }
+    if (!self->pages[page])
+    {
+	self->pages[page] = PSC_malloc(PAGESIZE * sizeof **self->pages);
+	memset(self->pages[page], 0, PAGESIZE * sizeof **self->pages);
+    }
+    if (self->pages[page][id & PAGEMASK]) return -1;
+    self->pages[page][id & PAGEMASK] = obj;
+    ++self->count;
+    return 0;
+}
+
+int ChanTable_alloc(ChanTable *self, uint32_t maxid, int skipzero,
+	void *obj, uint32_t *id)
+{
+    if (maxid > CHANTABLE_MAXID) maxid = CHANTABLE_MAXID;
+    uint32_t newid;
+    do
+    {
+	if (self->freecount > REUSEDELAY
+		|| (self->freecount && self->nextid > maxid))
+	{
+	    newid = self->freeids[self->freefirst];
+	    if (++self->freefirst == self->freesize) self->freefirst = 0;
+	    --self->freecount;
+	}
+	else if (self->nextid <= maxid) newid = self->nextid++;
+	else return -1;
+    } while (skipzero && !(newid & 0xffU));
+    if (ChanTable_set(self, newid, obj) < 0) return -1;
+    *id = newid;
+    return 0;
+}
+
+void ChanTable_remove(ChanTable *self, uint32_t id)
+{
+    size_t page = id >> PAGEBITS;
+    if (page >= self->npages || !self->pages[page]
+	    || !self->pages[page][id & PAGEMASK]) return;
+    self->pages[page][id & PAGEMASK] = 0;
+    --self->count;
+
+    /* only ids handed out by ChanTable_alloc() are recycled */
+    if (id >= self->nextid) return;
+    if (self->freecount == self->freesize)
+    {
+	size_t freesize = self->freesize ? 2 * self->freesize : 64;
+	self->freeids = PSC_realloc(self->freeids,
+		freesize * sizeof *self->freeids);
+	/* the ring is full, move its wrapped part behind the old end */
+	memcpy(self->freeids + self->freesize, self->freeids,
+		self->freefirst * sizeof *self->freeids);
+	self->freesize = freesize;
+    }
+    size_t pos = self->freefirst + self->freecount++;
+    if (pos >= self->freesize) pos -= self->freesize;
+    self->freeids[pos] = id;
+}
+
+size_t ChanTable_count(const ChanTable *self)
+{
+    return self->count;
+}
+
+void ChanTable_foreach(const ChanTable *self,
+	void (*func)(void *obj, void *arg), void *arg)
+{
+    for (size_t page = 0; page < self->npages; ++page)
+    {
+	if (!self->pages[page]) continue;
+	for (size_t i = 0; i < PAGESIZE; ++i)
+	{
+	    if (self->pages[page][i]) func(self->pages[page][i], arg);
+	}
+    }
+}
+
+void ChanTable_destroy(ChanTable *self, void (*deleter)(void *))
+{
+    if (!self) return;
+    for (size_t page = 0; page < self->npages; ++page)
+    {
+	if (!self->pages[page]) continue;
+	if (deleter) for (size_t i = 0; i < PAGESIZE; ++i)
+	{
+	    if (self->pages[page][i]) deleter(self->pages[page][i]);
+	}
+	free(self->pages[page]);
+    }
+    free(self->pages);
+    free(self->freeids);
+    free(self);
+}
@@ -0,0 +1,22 @@
+#ifndef REMUSOCKD_CHANTABLE_H
+#define REMUSOCKD_CHANTABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CHANTABLE_MAXID 0xffffffU
+
+typedef struct ChanTable ChanTable;
+
+ChanTable *ChanTable_create(void);
+void *ChanTable_get(const ChanTable *self, uint32_t id);
+int ChanTable_set(ChanTable *self, uint32_t id, void *obj);
+int ChanTable_alloc(ChanTable *self, uint32_t maxid, int skipzero,
+	void *obj, uint32_t *id);
+void ChanTable_remove(ChanTable *self, uint32_t id);
+size_t ChanTable_count(const ChanTable *self);
+void ChanTable_foreach(const ChanTable *self,
+	void (*func)(void *obj, void *arg), void *arg);
+void ChanTable_destroy(ChanTable *self, void (*deleter)(void *));
+
+#endif
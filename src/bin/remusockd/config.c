@@ -11,6 +11,14 @@
 #include <sys/types.h>
 
 #define ARGBUFSZ 16
+#define COALESCE 1024
+#define MAXCOALESCE (64*1024)
+#define MAXDELAY 1000
+#define MAXRESUME 3600
+#define SENDQUEUE 262144
+#define MAXSENDQUEUE (64*1024*1024)
+#define MAXTUNNELS 16
+#define MAXWINDOW (64*1024*1024)
 
 #ifndef PIDFILE
 #define PIDFILE "/var/run/remusockd.pid"
@@ -21,31 +29,72 @@
 
 static void usage(const char *prgname)
 {
-    fprintf(stderr, "Usage: %s [-Vcfntv] [-C CAfile] [-H hash[:hash...]]\n"
-	    "\t\t[-b address] [-g group] [-m mode] [-p pidfile]\n"
-	    "\t\t[-r remotehost] [-u user] socket port [cert key]\n",
+    fprintf(stderr, "Usage: %s [-BVcfntvz] [-C CAfile] [-H hash[:hash...]]\n"
+	    "\t\t[-N tunnels] [-a bytes] [-b address] [-d ms] [-g group]\n"
+	    "\t\t[-k seconds] [-m mode] [-p pidfile] [-q bytes]\n"
+	    "\t\t[-r remotehost] [-s ctlsocket] [-u user] [-w bytes]\n"
+	    "\t\tsocket port [cert key]\n",
 	    prgname);
-    fputs("\n\t-C CAfile      A file with one or more CA certificates in\n"
+    fputs("\n\t-B             bond the tunnels (see -N): the data of busy\n"
+	    "\t               socket connections is spread across all of\n"
+	    "\t               them, for more throughput than a single TCP\n"
+	    "\t               connection gets. The remote side needs -B\n"
+	    "\t               as well. Losing one tunnel closes all socket\n"
+	    "\t               connections. Can't be combined with -k or\n"
+	    "\t               several -r.\n"
+	    "\t-C CAfile      A file with one or more CA certificates in\n"
 	    "\t               PEM format. When listening, require a client\n"
 	    "\t               certificate issued by one of these CAs.\n"
 	    "\t-H hash[:...]  One or more SHA-512 hashes (128 hex digits).\n"
 	    "\t               When listening, require a client certificate\n"
 	    "\t               matching one of these hashes (fingerprints).\n"
+	    "\t-N tunnels     number of parallel TCP connections to spread\n"
+	    "\t               socket connections across, when connecting,\n"
+	    "\t               open this many, when listening as a socket\n"
+	    "\t               server, accept this many (1 - " STR(MAXTUNNELS) "),\n"
+	    "\t               defaults to 1\n"
 	    "\t-V             When connecting to a remote host with TLS,\n"
 	    "\t               don't verify the server certificate\n"
+	    "\t-a bytes       with -d, socket reads smaller than this are\n"
+	    "\t               held to be merged with further data from\n"
+	    "\t               the same socket connection into a single\n"
+	    "\t               frame, 0 disables holding, defaults to "
+	    STR(COALESCE) "\n"
 	    "\t-b address     when listening, only bind to this address\n"
 	    "\t               instead of any\n"
 	    "\t               (can be given up to " STR(MAXBINDS) " times)\n"
 	    "\t-c             open unix domain socket as client\n"
+	    "\t-d ms          hold small socket reads (see -a) for up to\n"
+	    "\t               this many milliseconds, even without a TCP\n"
+	    "\t               write in progress, to merge more of them,\n"
+	    "\t               defaults to 0 (don't delay)\n"
 	    "\t-f             run in foreground\n"
 	    "\t-g group       group name or id for the server socket,\n"
 	    "\t               if a user name is given, defaults to the\n"
-	    "\t               default group of that user\n"
+	    "\t               default group of that user\n",
+	    stderr);
+    fputs("\t-k seconds     when the TCP connection is lost, keep the\n"
+	    "\t               socket connections open for this many\n"
+	    "\t               seconds, they continue without loss if the\n"
+	    "\t               session is resumed with a new connection\n"
+	    "\t               in time (the remote side needs -k as well),\n"
+	    "\t               defaults to 0 (disabled)\n"
 	    "\t-m mode        permissions for the server socket in octal,\n"
 	    "\t               defaults to 600\n"
 	    "\t-n             numeric hosts, do not resolve remote addresses\n"
 	    "\t-p pidfile     use `pidfile' instead of compile-time default\n"
+	    "\t-q bytes       maximum number of bytes per socket connection\n"
+	    "\t               waiting to be sent through TCP before reading\n"
+	    "\t               from the socket is paused, 0 means send only\n"
+	    "\t               one chunk at a time, defaults to " STR(SENDQUEUE) "\n"
 	    "\t-r remotehost  connect to `remotehost' instead of listening\n"
+	    "\t               (can be given up to " STR(MAXREMOTES)
+	    " times, tunnels are\n"
+	    "\t               spread across all hosts that are up, and\n"
+	    "\t               move to another one when a host goes down)\n"
+	    "\t-s ctlsocket   unix domain socket reporting statistics of\n"
+	    "\t               all tunnels and their socket connections\n"
+	    "\t               to every client connecting to it\n"
 	    "\t-t             Enable TLS. This is implied when a cert and\n"
 	    "\t               key, or -C or -H are given. When listening\n"
 	    "\t               with TLS enabled, cert and key are required\n"
@@ -54,6 +103,17 @@ static void usage(const char *prgname)
 	    "\t-u user        user name or id for the server socket\n"
 	    "\t               when started as root, run as this user\n"
 	    "\t-v             verbose logging output\n"
+	    "\t-w bytes       receive window per socket connection, the\n"
+	    "\t               amount of data the remote side may send\n"
+	    "\t               before it must wait for the socket to\n"
+	    "\t               consume it. Raise this for fast transfers\n"
+	    "\t               over links with a long round-trip time.\n"
+	    "\t               Values below the protocol default (2097152\n"
+	    "\t               with recent versions) have no effect.\n"
+	    "\t-z             compress data sent through TCP when the\n"
+	    "\t               remote side uses -z as well, automatically\n"
+	    "\t               paused for connections where it doesn't pay\n"
+	    "\t               off (needs zstd support at build time)\n"
 	    "\n"
 	    "\tsocket         unix domain socket to open\n"
 	    "\tport           TCP port to connect to or listen on\n"
@@ -124,6 +184,18 @@ static int optArg(Config *config, char *args, int *idx, char *op)
 	    config->hashes = op;
 	    config->tls = 1;
 	    break;
+	case 'N':
+	    if (intArg(&config->tunnels, op, 1, MAXTUNNELS, 10) < 0)
+	    {
+		return -1;
+	    }
+	    break;
+	case 'a':
+	    if (intArg(&config->coalesce, op, 0, MAXCOALESCE, 10) < 0)
+	    {
+		return -1;
+	    }
+	    break;
 	case 'b':
 	    for (i = 0; i < MAXBINDS; ++i)
 	    {
@@ -135,6 +207,12 @@ static int optArg(Config *config, char *args, int *idx, char *op)
 	    }
 	    if (i == MAXBINDS) return -1;
 	    break;
+	case 'd':
+	    if (intArg(&config->delay, op, 0, MAXDELAY, 10) < 0)
+	    {
+		return -1;
+	    }
+	    break;
 	case 'g':
 	    if (longArg(&config->sockgid, op) < 0)
 	    {
@@ -143,14 +221,37 @@ static int optArg(Config *config, char *args, int *idx, char *op)
 		config->sockgid = g->gr_gid;
 	    }
 	    break;
+	case 'k':
+	    if (intArg(&config->resume, op, 0, MAXRESUME, 10) < 0)
+	    {
+		return -1;
+	    }
+	    break;
 	case 'm':
 	    if (intArg(&config->sockmode, op, 0, 0777, 8) < 0) return -1;
 	    break;
 	case 'p':
 	    config->pidfile = op;
 	    break;
+	case 'q':
+	    if (intArg(&config->sendqueue, op, 0, MAXSENDQUEUE, 10) < 0)
+	    {
+		return -1;
+	    }
+	    break;
 	case 'r':
-	    config->remotehost = op;
+	    for (i = 0; i < MAXREMOTES; ++i)
+	    {
+		if (!config->remotehost[i])
+		{
+		    config->remotehost[i] = op;
+		    break;
+		}
+	    }
+	    if (i == MAXREMOTES) return -1;
+	    break;
+	case 's':
+	    config->ctlsock = op;
 	    break;
 	case 'u':
 	    if (longArg(&config->sockuid, op) < 0)
@@ -164,6 +265,12 @@ static int optArg(Config *config, char *args, int *idx, char *op)
 		}
 	    }
 	    break;
+	case 'w':
+	    if (intArg(&config->window, op, 0, MAXWINDOW, 10) < 0)
+	    {
+		return -1;
+	    }
+	    break;
 	default:
 	    return -1;
     }
@@ -181,13 +288,16 @@ int Config_fromOpts(Config *config, int argc, char **argv)
     int arg;
     int naidx = 0;
     char needargs[ARGBUFSZ];
-    const char onceflags[] = "CHVcfgmnprtuv";
+    const char onceflags[] = "BCHNVacdfgkmnpqstuvwz";
     char seen[sizeof onceflags - 1] = {0};
 
     memset(config, 0, sizeof *config);
     config->pidfile = PIDFILE;
     config->daemonize = 1;
     config->sockmode = 0600;
+    config->sendqueue = SENDQUEUE;
+    config->coalesce = COALESCE;
+    config->tunnels = 1;
     config->sockuid = -1;
     config->sockgid = -1;
 
@@ -228,15 +338,26 @@ int Config_fromOpts(Config *config, int argc, char **argv)
 		{
 		    case 'C':
 		    case 'H':
+		    case 'N':
+		    case 'a':
 		    case 'b':
+		    case 'd':
 		    case 'g':
+		    case 'k':
 		    case 'm':
 		    case 'p':
+		    case 'q':
 		    case 'r':
+		    case 's':
 		    case 'u':
+		    case 'w':
 			if (addArg(needargs, &naidx, *o) < 0) return -1;
 			break;
 
+		    case 'B':
+			config->bond = 1;
+			break;
+
 		    case 'V':
 			config->noverify = 1;
 			config->tls = 1;
@@ -262,6 +383,10 @@ int Config_fromOpts(Config *config, int argc, char **argv)
 			PSC_Log_setMaxLogLevel(PSC_L_DEBUG);
 			break;
 
+		    case 'z':
+			config->compress = 1;
+			break;
+
 		    default:
 			if (optArg(config, needargs, &naidx, o) < 0)
 			{
@@ -310,10 +435,11 @@ int Config_fromOpts(Config *config, int argc, char **argv)
 next:	;
     }
     if (naidx || needsocket || needport || needkey
-	    || (config->remotehost && config->bindaddr[0])
-	    || (config->remotehost && (config->cacerts || config->hashes))
-	    || (!config->remotehost && config->tls && !config->cert)
-	    || (!config->remotehost && config->noverify))
+	    || (config->remotehost[0] && config->bindaddr[0])
+	    || (config->remotehost[0] && (config->cacerts || config->hashes))
+	    || (!config->remotehost[0] && config->tls && !config->cert)
+	    || (!config->remotehost[0] && config->noverify)
+	    || (config->bond && (config->resume || config->remotehost[1])))
     {
 	usage(prgname);
 	return -1;
@@ -5,25 +5,38 @@
 #define MAXBINDS 4
 #endif
 
+#ifndef MAXREMOTES
+#define MAXREMOTES 4
+#endif
+
 typedef struct Config
 {
     char **argv;
     const char *bindaddr[MAXBINDS];
     const char *pidfile;
     const char *sockname;
-    const char *remotehost;
+    const char *remotehost[MAXREMOTES];
     const char *cert;
     const char *key;
     const char *cacerts;
     const char *hashes;
+    const char *ctlsock;
     long sockuid;
     long sockgid;
     int sockClient;
+    int bond;
     int daemonize;
     int port;
     int numericHosts;
     int sockmode;
+    int sendqueue;
+    int coalesce;
+    int delay;
+    int resume;
+    int tunnels;
+    int window;
     int tls;
+    int compress;
     int noverify;
 } Config;
 
@@ -0,0 +1,86 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include "latency.h"
+
+#include <poser/core.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SUBBITS 4
+#define SUBS (1U << SUBBITS)
+#define MAXBITS 40
+#define MAXVAL ((1ULL << MAXBITS) - 1)
+#define NBUCKETS ((MAXBITS - SUBBITS + 1) * SUBS)
+
+struct Latency
+{
+    unsigned long long count;
+    unsigned long long buckets[NBUCKETS];
+};
+
+static unsigned bucket(uint64_t usecs);
+static uint64_t upperbound(unsigned idx);
+
+static unsigned bucket(uint64_t usecs)
+{
+    if (usecs < SUBS) return usecs;
+    if (usecs > MAXVAL) usecs = MAXVAL;
+    unsigned exp = SUBBITS;
+    while (usecs >> (exp + 1)) ++exp;
+    return (exp - SUBBITS + 1) * SUBS
+	+ ((usecs >> (exp - SUBBITS)) & (SUBS - 1));
+}
+
+static uint64_t upperbound(unsigned idx)
+{
+    if (idx < SUBS) return idx;
+    unsigned exp = idx / SUBS + SUBBITS - 1;
+    uint64_t low = (uint64_t)(SUBS + idx % SUBS) << (exp - SUBBITS);
+    return low + (1ULL << (exp - SUBBITS)) - 1;
+}
+
+uint64_t Latency_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000U + ts.tv_nsec / 1000;
+}
+
+Latency *Latency_create(void)
+{
+    Latency *self = PSC_malloc(sizeof *self);
+    memset(self, 0, sizeof *self);
+    return self;
+}
+
+void Latency_add(Latency *self, uint64_t usecs)
+{
+    ++self->buckets[bucket(usecs)];
+    ++self->count;
+}
+
+unsigned long long Latency_count(const Latency *self)
+{
+    return self->count;
+}
+
+uint64_t Latency_percentile(const Latency *self, double percentile)
+{
+    if (!self->count) return 0;
+    double exact = percentile / 100.0 * self->count;
+    unsigned long long rank = exact;
+    if (rank < exact || rank < 1) ++rank;
+    if (rank > self->count) rank = self->count;
+    unsigned long long seen = 0;
+    unsigned idx = 0;
+    while ((seen += self->buckets[idx]) < rank) ++idx;
+    return upperbound(idx);
+}
+
+void Latency_destroy(Latency *self)
+{
+    free(self);
+}
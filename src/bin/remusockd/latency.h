@@ -0,0 +1,20 @@
+#ifndef REMUSOCKD_LATENCY_H
+#define REMUSOCKD_LATENCY_H
+
+#include <stdint.h>
+
+typedef struct Latency Latency;
+
+/* microseconds from a monotonic clock */
+uint64_t Latency_now(void);
+
+/* A histogram of durations in microseconds with logarithmic buckets, each
+ * power of two split in 16 linear steps, so percentiles are reported with
+ * an error of at most about 6% and recording is constant time. */
+Latency *Latency_create(void);
+void Latency_add(Latency *self, uint64_t usecs);
+unsigned long long Latency_count(const Latency *self);
+uint64_t Latency_percentile(const Latency *self, double percentile);
+void Latency_destroy(Latency *self);
+
+#endif
@@ -0,0 +1,142 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include "chantable.h"
+
+#include <errno.h>
+#include <poser/core.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* This times looking up open channels in the ChanTable and in the hash
+ * table keyed by channel id strings that remusockd used before. */
+
+#define DEFLOOKUPS 1000000
+#define LOOKUPIDS 4096
+
+static volatile uintptr_t sink;
+
+static const size_t channelcounts[] = { 10, 1000, 60000 };
+
+static void usage(const char *prgname);
+static uint64_t nsecs(void);
+static const char *key(uint16_t id);
+static void lookups(size_t channels, long count);
+
+static void usage(const char *prgname)
+{
+    fprintf(stderr, "Usage: %s [-n lookups]\n", prgname);
+    fputs("\n\t-n lookups     number of lookups per table and number of\n"
+	    "\t               open channels, defaults to 1000000\n"
+	    "\n"
+	    "One line of JSON per number of open channels (10, 1000 and\n"
+	    "60000) is written to stdout, with the time per lookup of a\n"
+	    "random open channel in both tables.\n\n",
+	    stderr);
+}
+
+static uint64_t nsecs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000U + ts.tv_nsec;
+}
+
+static const char *key(uint16_t id)
+{
+    /* how channels were keyed in the hash table */
+    static char key[sizeof id + 1];
+    memcpy(key, &id, sizeof id);
+    key[sizeof id] = 0;
+    return key;
+}
+
+static void lookups(size_t channels, long count)
+{
+    ChanTable *table = ChanTable_create();
+    PSC_HashTable *hash = PSC_HashTable_create(6);
+    uint16_t *ids = PSC_malloc(channels * sizeof *ids);
+    uint16_t *seq = PSC_malloc(LOOKUPIDS * sizeof *seq);
+
+    /* ids with a zero low byte all map to the empty key, the hash table
+     * never had them in use at the same time */
+    uint16_t id = 0;
+    for (size_t i = 0; i < channels; ++i)
+    {
+	if (!(++id & 0xffU)) ++id;
+	ids[i] = id;
+	ChanTable_set(table, id, ids + i);
+	PSC_HashTable_set(hash, key(id), ids + i, 0);
+    }
+    uint32_t x = 1;
+    for (size_t i = 0; i < LOOKUPIDS; ++i)
+    {
+	x = x * 1103515245U + 12345U;
+	seq[i] = ids[(x >> 8) % channels];
+    }
+
+    uintptr_t found = 0;
+    uint64_t start = nsecs();
+    for (long i = 0; i < count; ++i)
+    {
+	found += (uintptr_t)ChanTable_get(table, seq[i % LOOKUPIDS]);
+    }
+    uint64_t tabletime = nsecs() - start;
+    start = nsecs();
+    for (long i = 0; i < count; ++i)
+    {
+	found += (uintptr_t)PSC_HashTable_get(hash, key(seq[i % LOOKUPIDS]));
+    }
+    uint64_t hashtime = nsecs() - start;
+    sink = found;
+
+    printf("{\"channels\":%zu,\"chantable_ns\":%.1f,\"hashtable_ns\":%.1f}\n",
+	    channels, (double)tabletime / count, (double)hashtime / count);
+    fflush(stdout);
+    PSC_HashTable_destroy(hash);
+    ChanTable_destroy(table, 0);
+    free(seq);
+    free(ids);
+}
+
+int main(int argc, char **argv)
+{
+    const char *prgname = argc > 0 ? argv[0] : "remusock-lookup";
+    long count = DEFLOOKUPS;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1)
+    {
+	char *endp;
+	switch (opt)
+	{
+	    case 'n':
+		errno = 0;
+		count = strtol(optarg, &endp, 10);
+		if (errno == ERANGE || *endp || count < 1)
+		{
+		    usage(prgname);
+		    return EXIT_FAILURE;
+		}
+		break;
+	    default:
+		usage(prgname);
+		return EXIT_FAILURE;
+	}
+    }
+    if (optind != argc)
+    {
+	usage(prgname);
+	return EXIT_FAILURE;
+    }
+
+    for (size_t i = 0; i < sizeof channelcounts / sizeof *channelcounts; ++i)
+    {
+	lookups(channelcounts[i], count);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,110 @@
+#include "pool.h"
+
+#include <poser/core.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct Slab Slab;
+
+struct Slab
+{
+    Slab *next;
+};
+
+typedef struct FreeObj FreeObj;
+
+struct FreeObj
+{
+    FreeObj *next;
+};
+
+struct Pool
+{
+    Slab *slabs;
+    FreeObj *free;
+    size_t objsize;
+    size_t slabobjs;
+    size_t slabused;
+    PoolStats stats;
+};
+
+/* the objects in a slab start right after the slab header, keep them
+ * aligned for any type */
+#define SLABHDRSZ ((sizeof(Slab) + sizeof(max_align_t) - 1) \
+	/ sizeof(max_align_t) * sizeof(max_align_t))
+
+Pool *Pool_create(size_t objsize, size_t slabobjs)
+{
+    Pool *self = PSC_malloc(sizeof *self);
+    memset(self, 0, sizeof *self);
+    if (objsize < sizeof(FreeObj)) objsize = sizeof(FreeObj);
+    self->objsize = (objsize + sizeof(max_align_t) - 1)
+	/ sizeof(max_align_t) * sizeof(max_align_t);
+    self->slabobjs = slabobjs ? slabobjs : 1;
+    self->slabused = self->slabobjs;
+    return self;
+}
+
+void *Pool_get(Pool *self)
+{
+    void *obj;
+    ++self->stats.allocs;
+    if (self->free)
+    {
+	obj = self->free;
+	self->free = self->free->next;
+	++self->stats.reused;
+    }
+    else
+    {
+	if (self->slabused == self->slabobjs)
+	{
+	    Slab *slab = PSC_malloc(SLABHDRSZ
+		    + self->slabobjs * self->objsize);
+	    memset(slab, 0, SLABHDRSZ + self->slabobjs * self->objsize);
+	    slab->next = self->slabs;
+	    self->slabs = slab;
+	    self->slabused = 0;
+	    ++self->stats.slabs;
+	}
+	obj = (char *)self->slabs + SLABHDRSZ
+	    + self->slabused++ * self->objsize;
+    }
+    if (++self->stats.inuse > self->stats.highwater)
+    {
+	self->stats.highwater = self->stats.inuse;
+    }
+    return obj;
+}
+
+void Pool_put(Pool *self, void *obj)
+{
+    if (!obj) return;
+    FreeObj *fo = obj;
+    fo->next = self->free;
+    self->free = fo;
+    --self->stats.inuse;
+}
+
+const PoolStats *Pool_stats(const Pool *self)
+{
+    return &self->stats;
+}
+
+void Pool_destroy(Pool *self, void (*cleanup)(void *))
+{
+    if (!self) return;
+    if (cleanup) while (self->free)
+    {
+	FreeObj *next = self->free->next;
+	cleanup(self->free);
+	self->free = next;
+    }
+    while (self->slabs)
+    {
+	Slab *next = self->slabs->next;
+	free(self->slabs);
+	self->slabs = next;
+    }
+    free(self);
+}
@@ -0,0 +1,26 @@
+#ifndef REMUSOCKD_POOL_H
+#define REMUSOCKD_POOL_H
+
+#include <stddef.h>
+
+typedef struct Pool Pool;
+
+typedef struct PoolStats
+{
+    size_t allocs;
+    size_t reused;
+    size_t inuse;
+    size_t highwater;
+    size_t slabs;
+} PoolStats;
+
+/* Objects are allocated from slabs of slabobjs objects each. A new object
+ * is zeroed, a reused one keeps its old contents except for the first
+ * pointer-sized bytes, which the pool uses while the object is free. */
+Pool *Pool_create(size_t objsize, size_t slabobjs);
+void *Pool_get(Pool *self);
+void Pool_put(Pool *self, void *obj);
+const PoolStats *Pool_stats(const Pool *self);
+void Pool_destroy(Pool *self, void (*cleanup)(void *));
+
+#endif
@@ -1,68 +1,331 @@
+#include "bonds.h"
+#include "chantable.h"
+#include "config.h"
+#include "latency.h"
+#include "pool.h"
 #include "protocol.h"
+#include "sessions.h"
+#include "stats.h"
+#include "tunnels.h"
 
 #include <poser/core.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
-#define IDLETICKS 60
-#define PINGTICKS 10
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#define IDLEMS 60000
+#define MINDEADMS 1000
+#define PINGMS 1000
+#define MINPINGMS 250
+#define RTTTICKS 5
+
+#define FEATURES (FEAT_WINDOW|FEAT_FRAMEV2|FEAT_EARLYDATA|FEAT_TIMESTAMP)
+#define CHANWINDOW (256*1024)
+#define BULKWINDOW (2*1024*1024)
+#define MAXCHUNK (16*1024)
+#define MAXFRAME (1024*1024)
+#define MAXFLUSH (1024*1024)
+#define QUANTUM (16*1024)
+#define STRIPE (64*1024)
+#define STRIPEEXT 5
+#define SLABCONNS 64
+#define POOLBUFMAX (64*1024)
+#define REMOTESZ 1024
+
+#ifdef WITH_ZSTD
+#define ZLEVEL 1
+#define ZWINDOWLOG 17
+#define ZOUTCHUNK (64*1024)
+#define ZPROBE (256*1024)
+#define ZBYPASS (8*1024*1024)
+#endif
 
 const uint8_t idsrv[] = { CMD_IDENT, ARG_SERVER };
 const uint8_t idcli[] = { CMD_IDENT, ARG_CLIENT };
 
-static const uint8_t cmdping[] = { CMD_PING };
-static const uint8_t cmdpong[] = { CMD_PONG };
+/* commands in the upper nibble of a version 2 frame header */
+static const uint8_t v2cmds[] = {
+    0, CMD_PING, CMD_PONG, CMD_HELLO, CMD_CONNECT, CMD_BYE, CMD_DATA,
+    CMD_WINDOW, CMD_JOIN, CMD_SDATA, CMD_ZDATA, CMD_SESSION, CMD_RESUME
+};
 
 typedef enum ProtoSt
 {
     PS_CMD,
-    PS_CLIENTNO,
-    PS_DATAHDR,
-    PS_DATA
+    PS_HDR,
+    PS_DATA,
+    PS_IDENT
 } ProtoSt;
 
-typedef struct Connection
+typedef enum NegSt
+{
+    NS_START,
+    NS_OFFER,
+    NS_CONFIRM,
+    NS_DONE
+} NegSt;
+
+typedef enum SessSt
+{
+    SS_NONE,
+    SS_REQUESTED,
+    SS_DONE
+} SessSt;
+
+typedef struct Buffer
+{
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+} Buffer;
+
+typedef struct Connection Connection;
+
+/* striped data that arrived ahead of what was written to the socket */
+typedef struct Segment Segment;
+struct Segment
+{
+    Segment *next;
+    uint32_t offset;
+    size_t len;
+    size_t filled;
+    uint8_t data[];
+};
+
+typedef struct ReadyList
+{
+    Connection *first;
+    Connection *last;
+} ReadyList;
+
+struct Connection
 {
     Protocol *proto;
     PSC_Connection *sockconn;
-    uint16_t id;
-    uint8_t msgbuf[5];
-} Connection;
+    Connection *prev;
+    Connection *next;
+    ReadyList *queued;
+    size_t deficit;
+    size_t credit;
+    size_t window;
+    Buffer sendq;
+    Buffer rcvbuf;
+    Buffer wrbuf;
+    Buffer replay;
+    size_t replayoff;
+    Segment *ahead;
+    ChannelStats stats;
+    uint64_t opened;
+    int windowed;
+    int early;
+    int connected;
+    int paused;
+    int stalled;
+    int bulk;
+    int resumable;
+    int resuming;
+    int rewind;
+    int striped;
+    int closing;
+    uint32_t id;
+    uint32_t acked;
+    uint32_t consumed;
+    uint32_t txpos;
+    uint32_t rxpos;
+    uint32_t finalpos;
+#ifdef WITH_ZSTD
+    ZSTD_CCtx *zc;
+    ZSTD_DCtx *zd;
+    size_t zin;
+    size_t zout;
+    size_t zbypass;
+    int compress;
+#endif
+};
 
 struct Protocol
 {
+    const Config *config;
     PSC_Connection *tcp;
-    PSC_Server *sockserver;
+    Tunnels *tunnels;
+    Sessions *sessions;
+    Bonds *bonds;
+    Stats *stats;
+    Bond *bond;
+    const uint8_t *bondref;
     PSC_UnixClientOpts *sockopts;
-    PSC_HashTable *connections;
+    ChanTable *channels;
+    Pool *connpool;
+    ReadyList sparse;
+    ReadyList bulk;
+    ReadyList held;
+    Buffer outq;
+    Buffer out;
+    Buffer ctlq;
+    Buffer ctlout;
+    Latency *rtt;
+    Latency *connect;
+    Latency *outwait;
+    uint64_t outqsince;
+    uint64_t outsince;
+    uint64_t pingsent;
+    PSC_Timer *timer;
+    PSC_Timer *holdtimer;
+    Buffer *pingbuf;
+    void *pingwrite;
+    unsigned long long rxbytes;
+    unsigned long long rxframes;
+    unsigned long long txbytes;
+    unsigned long long frames;
+    unsigned long long flushes;
+    unsigned long long reads;
+    unsigned long long merged;
+    unsigned long long dataframes;
+#ifdef WITH_ZSTD
+    unsigned long long zin;
+    unsigned long long zout;
+    Buffer zbuf;
+#endif
+    size_t bufreused;
+    size_t window;
+    size_t peerwin;
+    unsigned outframes;
+    unsigned ctlframes;
+    size_t remaining;
+    size_t hdrsz;
+    size_t hdrlen;
     ProtoSt state;
+    NegSt negst;
+    SessSt session;
+    int stalled;
+    int bypass;
+    int listed;
     int ticks;
-    uint16_t nextid;
-    uint16_t cmdid;
+    int idle;
+    int deadline;
+    int rttticks;
+    int sessticks;
+    int tcpclient;
+    unsigned member;
+    uint16_t features;
+    uint16_t sendfeat;
+    uint16_t recvfeat;
+    uint8_t *tokenref;
+    uint32_t cmdid;
+    uint32_t rxoff;
+    uint8_t rxhome;
     uint8_t cmd;
+    uint8_t idsz;
+    uint8_t argsz;
+    uint8_t hdr[8 + SESSION_TOKENSZ];
+    uint8_t token[SESSION_TOKENSZ];
+    char remote[REMOTESZ];
 };
 
-static const char *remotestr(PSC_Connection *c);
-static const char *key(uint16_t id);
+typedef struct ChanReport
+{
+    void (*report)(void *arg, const ChannelStats *stats);
+    void *arg;
+} ChanReport;
+
+static const uint8_t notoken[SESSION_TOKENSZ];
+
+static const char *remotestr(char *buf, PSC_Connection *c);
+static void reservebuf(Buffer *buf, size_t sz);
+static void appendbuf(Buffer *buf, const uint8_t *data, size_t sz);
+static void swapbuf(Buffer *a, Buffer *b);
+static void consumebuf(Buffer *buf, size_t sz);
+static int hasid(uint8_t cmd);
+static int hasarg(uint8_t cmd, uint16_t features);
+static size_t v1argsz(uint8_t cmd);
+static size_t fieldsz(uint32_t val);
+static uint8_t *putfield(uint8_t *p, uint32_t val, size_t sz);
+static uint32_t getfield(const uint8_t *p, size_t sz);
+static void sendframe(Protocol *self, const uint8_t *frame, size_t sz);
+static void sendext(Protocol *self, uint8_t cmd, uint32_t id, uint32_t arg,
+	const uint8_t *ext, size_t extsz);
+static void sendctl(Protocol *self, const uint8_t *frame, size_t sz);
+static void sendhdr(Protocol *self, uint8_t cmd, uint32_t id, uint32_t arg);
+static void sendcmd(Connection *conn, uint8_t cmd);
+static void sendping(Protocol *self);
+static void pong(Protocol *self, uint32_t stamp);
+static void sendident(Protocol *self, uint16_t features);
+static void sendfeatures(Protocol *self);
+static void sendwindow(Connection *conn, size_t credit);
+static void sendresume(Connection *conn);
+static Protocol *stripeto(Protocol *self);
+static void stripe(Connection *conn, const uint8_t *data, size_t sz);
+#ifdef WITH_ZSTD
+static int deflatedata(Connection *conn, const uint8_t *data, size_t sz);
+static int inflatedata(Connection *conn, const uint8_t *data, size_t sz);
+#endif
+static void keepsent(Connection *conn, const uint8_t *data, size_t sz);
+static void framedata(Connection *conn, const uint8_t *data, size_t sz);
+static size_t senddata(Connection *conn, size_t maxsz);
+static void enqueue(ReadyList *list, Connection *conn);
+static void schedule(Connection *conn);
+static void hold(Connection *conn);
+static void release(void *receiver, void *sender, void *args);
+static void unschedule(Connection *conn);
+static void flushsock(Connection *conn);
+static void keepbuf(Buffer *buf);
+static Connection *newconn(Protocol *self);
+static void freebufs(void *ptr);
 static void deleteconn(void *ptr);
+static void unstall(Connection *conn);
+static void removeconn(Connection *conn);
+static void endconn(Connection *conn);
+static Connection *stripeconn(Protocol *self);
+static int stripein(Connection *conn, uint32_t off, size_t sz);
+static void reassemble(Connection *conn);
+static void stripedata(Connection *conn, uint32_t off,
+	const uint8_t *data, size_t sz);
 static void sockconnected(void *receiver, void *sender, void *args);
 static void sockclosed(void *receiver, void *sender, void *args);
 static void sockreceived(void *receiver, void *sender, void *args);
 static void socksent(void *receiver, void *sender, void *args);
-static void socknewclient(void *receiver, void *sender, void *args);
-static int addconnection(Protocol *self, uint16_t id, PSC_Connection *sockconn);
+static void writeout(Protocol *self);
+static void flush(void *receiver, void *sender, void *args);
+static int addconnection(Protocol *self, uint32_t id, PSC_Connection *sockconn);
+static void ready(Protocol *self);
+static void adoptconn(void *obj, void *arg);
+static void resumeconn(void *obj, void *arg);
+static void detachconn(void *obj, void *arg);
+static void adopt(Protocol *self, Protocol *old);
+static int session(Protocol *self, const uint8_t *token, uint32_t window);
+static int resume(Protocol *self, Connection *conn, uint32_t pos);
+static int join(Protocol *self, uint32_t index, const uint8_t *id);
+static void dropconn(void *obj, void *arg);
+static void unbond(Protocol *self);
 static void sent(void *receiver, void *sender, void *args);
 static void received(void *receiver, void *sender, void *args);
+static void receive(Protocol *self, const uint8_t *buf, size_t sz);
+static int command(Protocol *self, uint8_t byte);
+static int header(Protocol *self, const uint8_t *hdr);
+static int payload(Protocol *self, const uint8_t *data, size_t sz);
+static int ident(Protocol *self, const uint8_t *data);
+static unsigned pingms(const Protocol *self);
+static unsigned deadms(const Protocol *self);
+static void watch(Protocol *self);
+static void startdeadline(Protocol *self, unsigned ms);
+static void expired(void *receiver, void *sender, void *args);
 static void tick(void *receiver, void *sender, void *args);
+static void addstats(void *obj, void *arg);
+static void chanreport(void *obj, void *arg);
+static void logclosed(Protocol *self);
 
-static const char *remotestr(PSC_Connection *c)
+static const char *remotestr(char *buf, PSC_Connection *c)
 {
+    /* a detached session keeps the last remote in buf */
+    if (!c) return buf;
     const char *remAddr = PSC_Connection_remoteAddr(c);
     const char *remHost = PSC_Connection_remoteHost(c);
     if (remAddr && remHost)
     {
-	static char buf[1024];
-        snprintf(buf, 1024, "%s [%s]", remHost, remAddr);
+        snprintf(buf, REMOTESZ, "%s [%s]", remHost, remAddr);
         return buf;
     }
     if (remHost) return remHost;
@@ -70,359 +333,1972 @@ static const char *remotestr(PSC_Connection *c)
     return "<unknown>";
 }
 
-static const char *key(uint16_t id)
+static void reservebuf(Buffer *buf, size_t sz)
 {
-    static char key[sizeof id + 1];
-    memcpy(key, &id, sizeof id);
-    key[sizeof id] = 0;
-    return key;
+    if (buf->len + sz > buf->cap)
+    {
+	while (buf->len + sz > buf->cap) buf->cap = buf->cap ? 2*buf->cap : 64;
+	buf->data = PSC_realloc(buf->data, buf->cap);
+    }
 }
 
-static void deleteconn(void *ptr)
+static void appendbuf(Buffer *buf, const uint8_t *data, size_t sz)
 {
-    if (!ptr) return;
-    Connection *conn = ptr;
-    if (conn->sockconn) PSC_Connection_close(conn->sockconn, 0);
-    free(conn);
+    if (!sz) return;
+    reservebuf(buf, sz);
+    memcpy(buf->data + buf->len, data, sz);
+    buf->len += sz;
 }
 
-static void sockconnected(void *receiver, void *sender, void *args)
+static void swapbuf(Buffer *a, Buffer *b)
 {
-    (void)sender;
-    (void)args;
-
-    Connection *conn = receiver;
-    PSC_Log_fmt(PSC_L_DEBUG, "Protocol: connected %s <-> %s",
-	    remotestr(conn->sockconn), remotestr(conn->proto->tcp));
-    conn->msgbuf[0] = CMD_CONNECT;
-    PSC_Connection_sendAsync(conn->proto->tcp, conn->msgbuf, 3, 0);
+    Buffer tmp = *a;
+    *a = *b;
+    *b = tmp;
 }
 
-static void sockclosed(void *receiver, void *sender, void *args)
+static void consumebuf(Buffer *buf, size_t sz)
 {
-    (void)sender;
-    (void)args;
+    buf->len -= sz;
+    if (buf->len) memmove(buf->data, buf->data + sz, buf->len);
+}
 
-    Connection *conn = receiver;
-    PSC_Log_fmt(PSC_L_DEBUG, "Protocol: disconnected %s <-> %s",
-	    remotestr(conn->sockconn), remotestr(conn->proto->tcp));
-    conn->sockconn = 0;
-    conn->msgbuf[0] = CMD_BYE;
-    PSC_Connection_sendAsync(conn->proto->tcp, conn->msgbuf, 3, conn);
+static int hasid(uint8_t cmd)
+{
+    return cmd != CMD_PING && cmd != CMD_PONG && cmd != CMD_SESSION
+	&& cmd != CMD_JOIN;
 }
 
-static void sockreceived(void *receiver, void *sender, void *args)
+static int hasarg(uint8_t cmd, uint16_t features)
 {
-    (void)sender;
+    if (cmd == CMD_PING || cmd == CMD_PONG)
+    {
+	return !!(features & FEAT_TIMESTAMP);
+    }
+    /* with bonding, BYE tells how much data was sent in total */
+    if (cmd == CMD_BYE) return !!(features & FEAT_BOND);
+    return cmd == CMD_DATA || cmd == CMD_ZDATA || cmd == CMD_WINDOW
+	|| cmd == CMD_SESSION || cmd == CMD_RESUME || cmd == CMD_JOIN
+	|| cmd == CMD_SDATA;
+}
 
-    Connection *conn = receiver;
-    PSC_EADataReceived *dra = args;
-    size_t sz = PSC_EADataReceived_size(dra);
-    conn->msgbuf[0] = CMD_DATA;
-    conn->msgbuf[3] = (sz >> 8 & 0xff);
-    conn->msgbuf[4] = sz & 0xff;
-    PSC_Connection_sendAsync(conn->proto->tcp, conn->msgbuf, 5, 0);
-    PSC_Connection_sendAsync(conn->proto->tcp, PSC_EADataReceived_buf(dra),
-	    sz, conn);
+static size_t v1argsz(uint8_t cmd)
+{
+    return cmd == CMD_DATA || cmd == CMD_ZDATA ? 2 : 4;
 }
 
-static void socksent(void *receiver, void *sender, void *args)
+static size_t fieldsz(uint32_t val)
 {
-    (void)sender;
-    (void)args;
+    if (val > 0xffffffU) return 4;
+    if (val > 0xffffU) return 3;
+    if (val > 0xffU) return 2;
+    return 1;
+}
 
-    Connection *conn = receiver;
-    PSC_Connection_confirmDataReceived(conn->proto->tcp);
+static uint8_t *putfield(uint8_t *p, uint32_t val, size_t sz)
+{
+    while (sz) *p++ = val >> (8 * --sz) & 0xff;
+    return p;
 }
 
-static void socknewclient(void *receiver, void *sender, void *args)
+static uint32_t getfield(const uint8_t *p, size_t sz)
 {
-    (void)sender;
+    uint32_t val = 0;
+    while (sz--) val = val << 8 | *p++;
+    return val;
+}
 
-    Protocol *self = receiver;
-    PSC_Connection *sockconn = args;
+static void sendframe(Protocol *self, const uint8_t *frame, size_t sz)
+{
+    if (!self->outq.len) self->outqsince = Latency_now();
+    appendbuf(&self->outq, frame, sz);
+    ++self->outframes;
+}
 
-    if (addconnection(self, 0, sockconn) < 0)
-    {
-	PSC_Log_msg(PSC_L_WARNING,
-		"Protocol: error accepting socket connection");
-	PSC_Connection_close(sockconn, 0);
-    }
+static void sendctl(Protocol *self, const uint8_t *frame, size_t sz)
+{
+    appendbuf(&self->ctlq, frame, sz);
+    ++self->ctlframes;
 }
 
-static int addconnection(Protocol *self, uint16_t id, PSC_Connection *sockconn)
+static void sendext(Protocol *self, uint8_t cmd, uint32_t id, uint32_t arg,
+	const uint8_t *ext, size_t extsz)
 {
-    const char *k;
-    if (self->sockserver)
+    uint8_t frame[9 + SESSION_TOKENSZ];
+    size_t idsz = 0;
+    size_t argsz = 0;
+
+    if (self->sendfeat & FEAT_FRAMEV2)
     {
-	uint16_t first = self->nextid;
-	do
-	{
-	    id = ++self->nextid;
-	    if (id == first) return -1;
-	    k = key(id);
-	} while (PSC_HashTable_get(self->connections, k));
+	/* version 2: 4 bits command, 2 bits each for the size of the
+	 * channel id and the argument (length or credit) in bytes - 1 */
+	uint8_t code = 0;
+	while (v2cmds[code] != cmd) ++code;
+	if (hasid(cmd)) idsz = fieldsz(id);
+	if (hasarg(cmd, self->sendfeat)) argsz = fieldsz(arg);
+	frame[0] = code << 4 | (idsz ? idsz - 1 : 0) << 2
+	    | (argsz ? argsz - 1 : 0);
     }
     else
     {
-	k = key(id);
-	if (PSC_HashTable_get(self->connections, k)) return -1;
+	frame[0] = cmd;
+	if (hasid(cmd)) idsz = 2;
+	if (hasarg(cmd, self->sendfeat)) argsz = v1argsz(cmd);
     }
+    uint8_t *p = putfield(frame + 1, id, idsz);
+    p = putfield(p, arg, argsz);
+    if (extsz) memcpy(p, ext, extsz);
+    p += extsz;
+
+    /* anything referring to a channel must stay in order behind its
+     * HELLO and ahead of its BYE, a channel id may be reused right after
+     * BYE. SESSION and RESUME must not be overtaken by WINDOW */
+    if (self->bypass && (cmd == CMD_PING || cmd == CMD_PONG
+		|| cmd == CMD_SESSION || cmd == CMD_RESUME))
+    {
+	sendctl(self, frame, p - frame);
+    }
+    else sendframe(self, frame, p - frame);
+}
 
-    Connection *conn = PSC_malloc(sizeof *conn);
-    conn->proto = self;
-    conn->id = id;
-    conn->msgbuf[1] = id >> 8;
-    conn->msgbuf[2] = id & 0xff;
+static void sendhdr(Protocol *self, uint8_t cmd, uint32_t id, uint32_t arg)
+{
+    sendext(self, cmd, id, arg, 0, 0);
+}
+
+static void sendcmd(Connection *conn, uint8_t cmd)
+{
+    sendhdr(conn->proto, cmd, conn->id, cmd == CMD_BYE ? conn->txpos : 0);
+}
+
+static void sendping(Protocol *self)
+{
+    /* with timestamps, the peer echoes our clock in its PONG, otherwise
+     * only one PING at a time is timed */
+    uint32_t stamp = 0;
+    if (self->sendfeat & FEAT_TIMESTAMP) stamp = Latency_now();
+    else if (self->pingsent) return;
+    else self->pingsent = Latency_now();
+    sendhdr(self, CMD_PING, 0, stamp);
+    self->pingbuf = self->bypass ? &self->ctlq : &self->outq;
+}
 
-    if (self->sockserver)
+static void pong(Protocol *self, uint32_t stamp)
+{
+    if (stamp)
     {
-	conn->sockconn = sockconn;
-	PSC_Connection_pause(sockconn);
-	conn->msgbuf[0] = CMD_HELLO;
-	PSC_Connection_sendAsync(self->tcp, conn->msgbuf, 3, 0);
+	Latency_add(self->rtt, (uint32_t)(Latency_now() - stamp));
     }
-    else
+    else if (self->pingsent)
     {
-	conn->sockconn = PSC_Connection_createUnixClient(self->sockopts);
-	if (!conn->sockconn)
-	{
-	    sockclosed(conn, 0, 0);
-	    goto done;
-	}
-	PSC_Event_register(PSC_Connection_connected(conn->sockconn), conn,
-		sockconnected, 0);
+	Latency_add(self->rtt, Latency_now() - self->pingsent);
+	self->pingsent = 0;
     }
-    PSC_Event_register(PSC_Connection_closed(conn->sockconn), conn,
-	    sockclosed, 0);
-    PSC_Event_register(PSC_Connection_dataReceived(conn->sockconn), conn,
-	    sockreceived, 0);
-    PSC_Event_register(PSC_Connection_dataSent(conn->sockconn), conn,
-	    socksent, 0);
+}
 
-done:
-    PSC_HashTable_set(self->connections, k, conn, deleteconn);
-    return 0;
+static void sendident(Protocol *self, uint16_t features)
+{
+    uint8_t frame[3] = { CMD_IDENT, features >> 8, features & 0xff };
+    sendframe(self, frame, sizeof frame);
 }
 
-static void sent(void *receiver, void *sender, void *args)
+static void sendfeatures(Protocol *self)
 {
-    (void)sender;
+    sendident(self, self->features);
+    self->sendfeat = self->features;
+}
 
-    Protocol *self = receiver;
-    Connection *conn = args;
+static void sendwindow(Connection *conn, size_t credit)
+{
+    sendhdr(conn->proto, CMD_WINDOW, conn->id, credit);
+}
 
-    if (conn->sockconn)
+static Protocol *stripeto(Protocol *self)
+{
+    /* the tunnel with the least output waiting, as long as writes keep
+     * up with the data, this is the home tunnel */
+    Protocol *best = self;
+    size_t bestlen = self->outq.len + self->out.len;
+    for (unsigned i = 0; i < BOND_MAXMEMBERS; ++i)
     {
-	PSC_Connection_confirmDataReceived(conn->sockconn);
+	Protocol *member = Bond_member(self->bond, i);
+	if (!member || member == self) continue;
+	size_t len = member->outq.len + member->out.len;
+	if (len < bestlen)
+	{
+	    best = member;
+	    bestlen = len;
+	}
     }
-    else
+    return best;
+}
+
+static void stripe(Connection *conn, const uint8_t *data, size_t sz)
+{
+    /* the channel is identified by the tunnel it belongs to and its id
+     * there, the position in its data tells the peer where to put it */
+    Protocol *self = conn->proto;
+    uint8_t ext[STRIPEEXT];
+    ext[0] = self->member;
+    for (size_t pos = 0; pos < sz; pos += STRIPE)
     {
-	PSC_HashTable_delete(self->connections, key(conn->id));
+	size_t chunksz = sz - pos;
+	if (chunksz > STRIPE) chunksz = STRIPE;
+	Protocol *via = stripeto(self);
+	putfield(ext + 1, conn->txpos + pos, 4);
+	++self->dataframes;
+	sendext(via, CMD_SDATA, conn->id, chunksz, ext, sizeof ext);
+	appendbuf(&via->outq, data + pos, chunksz);
+	++conn->stats.txframes;
+	conn->stats.txbytes += chunksz;
     }
 }
 
-static void received(void *receiver, void *sender, void *args)
+static void sendresume(Connection *conn)
 {
-    Protocol *self = receiver;
-    PSC_Connection *tcp = sender;
-    PSC_EADataReceived *dra = args;
+    /* the peer sends everything again the socket didn't consume yet,
+     * starting a new zstd frame */
+    conn->rewind = 0;
+    conn->rcvbuf.len = 0;
+#ifdef WITH_ZSTD
+    if (conn->zd) ZSTD_DCtx_reset(conn->zd, ZSTD_reset_session_only);
+#endif
+    sendhdr(conn->proto, CMD_RESUME, conn->id, conn->consumed);
+}
 
-    self->ticks = IDLETICKS;
+#ifdef WITH_ZSTD
+static int deflatedata(Connection *conn, const uint8_t *data, size_t sz)
+{
+    Protocol *self = conn->proto;
 
-    const uint8_t *buf = PSC_EADataReceived_buf(dra);
-    Connection *conn;
+    if (conn->zbypass)
+    {
+	conn->zbypass -= sz < conn->zbypass ? sz : conn->zbypass;
+	return -1;
+    }
+    if (!conn->zc)
+    {
+	conn->zc = ZSTD_createCCtx();
+	if (!conn->zc) return -1;
+	ZSTD_CCtx_setParameter(conn->zc, ZSTD_c_compressionLevel, ZLEVEL);
+	ZSTD_CCtx_setParameter(conn->zc, ZSTD_c_windowLog, ZWINDOWLOG);
+    }
 
-    switch (self->state)
+    /* flush after every chunk, so each frame can be decompressed as soon
+     * as it arrives */
+    self->zbuf.len = 0;
+    reservebuf(&self->zbuf, ZSTD_compressBound(sz));
+    ZSTD_inBuffer in = { data, sz, 0 };
+    ZSTD_outBuffer out = { self->zbuf.data, self->zbuf.cap, 0 };
+    size_t rc;
+    do
     {
-	case PS_CMD:
-	    self->cmd = buf[0];
-	    switch (self->cmd)
-	    {
-		case CMD_PING:
-		    PSC_Connection_sendAsync(tcp, cmdpong, 1, 0);
-		    break;
-
-		case CMD_PONG:
-		    break;
-
-		case CMD_HELLO:
-		case CMD_CONNECT:
-		case CMD_BYE:
-		    self->state = PS_CLIENTNO;
-		    PSC_Connection_receiveBinary(tcp, 2);
-		    break;
-
-		case CMD_DATA:
-		    self->state = PS_DATAHDR;
-		    PSC_Connection_receiveBinary(tcp, 4);
-		    break;
-
-		default:
-		    goto error;
-	    }
-	    break;
+	rc = ZSTD_compressStream2(conn->zc, &out, &in, ZSTD_e_flush);
+    } while (!ZSTD_isError(rc) && rc && out.pos < out.size);
+
+    size_t zsz = out.pos;
+    int ok = !ZSTD_isError(rc) && !rc && zsz < sz;
+    conn->zin += sz;
+    conn->zout += ok ? zsz : sz;
+    self->zin += sz;
+    self->zout += ok ? zsz : sz;
+    if (ok)
+    {
+	sendhdr(self, CMD_ZDATA, conn->id, zsz);
+	appendbuf(&self->outq, self->zbuf.data, zsz);
+	++conn->stats.txframes;
+	conn->stats.txbytes += zsz;
+    }
+    else
+    {
+	/* the peer won't see this output, so start over with a new zstd
+	 * frame, the peer resets as well on receiving plain data */
+	ZSTD_CCtx_reset(conn->zc, ZSTD_reset_session_only);
+    }
 
-	case PS_CLIENTNO:
-	    self->cmdid = buf[0] << 8 | buf[1];
-	    switch (self->cmd)
-	    {
-		case CMD_HELLO:
-		    if (self->sockserver) goto error;
-		    if (addconnection(self, self->cmdid, 0) < 0) goto error;
-		    break;
-
-		case CMD_CONNECT:
-		    if (!self->sockserver) goto error;
-		    conn = PSC_HashTable_get(
-			    self->connections, key(self->cmdid));
-		    if (!conn) goto error;
-		    PSC_Connection_resume(conn->sockconn);
-		    PSC_Log_fmt(PSC_L_DEBUG, "Protocol: connected %s <-> %s",
-			    remotestr(conn->sockconn), remotestr(tcp));
-		    break;
-
-		case CMD_BYE:
-		    conn = PSC_HashTable_get(self->connections,
-			    key(self->cmdid));
-		    if (!conn) goto error;
-		    PSC_Event_unregister(PSC_Connection_closed(conn->sockconn),
-			    conn, sockclosed, 0);
-		    PSC_HashTable_delete(self->connections, key(self->cmdid));
-		    PSC_Log_fmt(PSC_L_DEBUG,
-			    "Protocol: disconnected %s <-> %s",
-			    remotestr(conn->sockconn), remotestr(tcp));
-		    break;
-
-		default:
-		    goto error;
-	    }
-	    self->state = PS_CMD;
-	    PSC_Connection_receiveBinary(tcp, 1);
-	    break;
+    if (conn->zin >= ZPROBE)
+    {
+	if (conn->zout > conn->zin / 10 * 9)
+	{
+	    /* saving less than 10%, not worth the CPU time for a while */
+	    if (ok) ZSTD_CCtx_reset(conn->zc, ZSTD_reset_session_only);
+	    conn->zbypass = ZBYPASS;
+	}
+	conn->zin = 0;
+	conn->zout = 0;
+    }
+    return ok ? 0 : -1;
+}
 
-	case PS_DATAHDR:
-	    self->state = PS_DATA;
-	    self->cmdid = buf[0] << 8 | buf[1];
-	    PSC_Connection_receiveBinary(tcp, buf[2] << 8 | buf[3]);
-	    break;
+static int inflatedata(Connection *conn, const uint8_t *data, size_t sz)
+{
+    if (!conn->zd)
+    {
+	conn->zd = ZSTD_createDCtx();
+	if (!conn->zd) return -1;
+	ZSTD_DCtx_setParameter(conn->zd, ZSTD_d_windowLogMax, ZWINDOWLOG);
+    }
 
-	case PS_DATA:
-	    conn = PSC_HashTable_get(self->connections, key(self->cmdid));
-	    if (!conn) goto error;
-	    PSC_EADataReceived_markHandling(dra);
-	    PSC_Connection_sendAsync(conn->sockconn, buf,
-		    PSC_EADataReceived_size(dra), conn);
-	    self->state = PS_CMD;
-	    PSC_Connection_receiveBinary(tcp, 1);
+    /* the window applies to the decompressed data */
+    ZSTD_inBuffer in = { data, sz, 0 };
+    size_t outsz;
+    do
+    {
+	size_t room = conn->window - conn->rcvbuf.len - conn->wrbuf.len;
+	if (!room)
+	{
+	    /* only acceptable if there's nothing left to decompress */
+	    uint8_t probe;
+	    ZSTD_outBuffer out = { &probe, 1, 0 };
+	    if (in.pos < in.size) return -1;
+	    if (ZSTD_isError(ZSTD_decompressStream(conn->zd, &out, &in))
+		    || out.pos) return -1;
 	    break;
-    }
+	}
+	outsz = room < ZOUTCHUNK ? room : ZOUTCHUNK;
+	reservebuf(&conn->rcvbuf, outsz);
+	ZSTD_outBuffer out = { conn->rcvbuf.data + conn->rcvbuf.len, outsz, 0 };
+	if (ZSTD_isError(ZSTD_decompressStream(conn->zd, &out, &in)))
+	{
+	    return -1;
+	}
+	conn->rcvbuf.len += out.pos;
+	outsz -= out.pos;
+    } while (in.pos < in.size || !outsz);
+    return 0;
+}
+#endif
 
-    return;
+static void keepsent(Connection *conn, const uint8_t *data, size_t sz)
+{
+    /* acknowledged data is only moved out once it's at least half of the
+     * buffer, so every byte is moved at most once on average */
+    if (conn->replayoff && conn->replayoff >= conn->replay.len / 2)
+    {
+	consumebuf(&conn->replay, conn->replayoff);
+	conn->replayoff = 0;
+    }
+    appendbuf(&conn->replay, data, sz);
+}
 
-error:
-    PSC_Log_fmt(PSC_L_WARNING, "Protocol: unexpected data from %s, "
-	    "closing connection", remotestr(self->tcp));
-    switch (self->state)
+static void framedata(Connection *conn, const uint8_t *data, size_t sz)
+{
+    Protocol *self = conn->proto;
+    if (self->bond && conn->bulk && (!self->tunnels || conn->connected))
     {
-	case PS_CMD:
-	    PSC_Log_fmt(PSC_L_DEBUG, "Protocol: unknown command 0x%02hhx",
-		    self->cmd);
-	    break;
+	/* once the peer knows the channel, its bulk data is spread across
+	 * all tunnels of the bond, and it stays that way, so the peer
+	 * only has to reorder striped data */
+	conn->striped = 1;
+    }
+    size_t maxchunk = (self->sendfeat & FEAT_FRAMEV2) ? MAXFRAME : MAXCHUNK;
+    if (conn->striped) stripe(conn, data, sz);
+    else for (size_t pos = 0; pos < sz; pos += maxchunk)
+    {
+	size_t chunksz = sz - pos;
+	if (chunksz > maxchunk) chunksz = maxchunk;
+	++self->dataframes;
+#ifdef WITH_ZSTD
+	if (conn->compress && deflatedata(conn, data + pos, chunksz) == 0)
+	{
+	    continue;
+	}
+#endif
+	sendhdr(self, CMD_DATA, conn->id, chunksz);
+	appendbuf(&self->outq, data + pos, chunksz);
+	++conn->stats.txframes;
+	conn->stats.txbytes += chunksz;
+    }
+    conn->txpos += sz;
+    if (conn->windowed) conn->credit -= sz;
+    if (conn->resumable) keepsent(conn, data, sz);
+}
 
-	case PS_CLIENTNO:
-	    PSC_Log_fmt(PSC_L_DEBUG, "Protocol: unknown client %u for "
-		    "command 0x%02hhx", (int)self->cmdid, self->cmd);
-	    break;
+static size_t senddata(Connection *conn, size_t maxsz)
+{
+    size_t sz = conn->sendq.len;
+    if (conn->windowed && sz > conn->credit) sz = conn->credit;
+    if (sz > maxsz) sz = maxsz;
+    framedata(conn, conn->sendq.data, sz);
+    consumebuf(&conn->sendq, sz);
+    return sz;
+}
 
-	case PS_DATA:
-	    PSC_Log_fmt(PSC_L_DEBUG, "Protocol: data for unknwon client %u",
-		    (int)self->cmdid);
-	    break;
+static void enqueue(ReadyList *list, Connection *conn)
+{
+    conn->queued = list;
+    conn->prev = list->last;
+    conn->next = 0;
+    if (list->last) list->last->next = conn;
+    else list->first = conn;
+    list->last = conn;
+}
 
-	default:
-	    break;
-    }
-    PSC_Connection_close(self->tcp, 0);
+static void schedule(Connection *conn)
+{
+    if (conn->queued || conn->resuming) return;
+    if (conn->sockconn && (!conn->sendq.len
+		|| (conn->windowed && !conn->credit))) return;
+    if (!conn->sockconn && conn->sendq.len
+	    && conn->windowed && !conn->credit) return;
+    Protocol *self = conn->proto;
+    enqueue(conn->bulk ? &self->bulk : &self->sparse, conn);
 }
 
-static void tick(void *receiver, void *sender, void *args)
+static void hold(Connection *conn)
+{
+    /* the scheduler doesn't see held channels, all of them are released
+     * together once the first one waited for the configured delay */
+    Protocol *self = conn->proto;
+    if (!self->held.first) PSC_Timer_start(self->holdtimer, 0);
+    enqueue(&self->held, conn);
+}
+
+static void release(void *receiver, void *sender, void *args)
 {
     (void)sender;
     (void)args;
 
     Protocol *self = receiver;
+    Connection *conn;
+    while ((conn = self->held.first))
+    {
+	unschedule(conn);
+	schedule(conn);
+    }
+}
+
+static void unschedule(Connection *conn)
+{
+    ReadyList *list = conn->queued;
+    if (!list) return;
+    if (conn->prev) conn->prev->next = conn->next;
+    else list->first = conn->next;
+    if (conn->next) conn->next->prev = conn->prev;
+    else list->last = conn->prev;
+    conn->queued = 0;
+}
 
-    int tickno = --self->ticks;
-    if (!tickno)
+static void flushsock(Connection *conn)
+{
+    if (!conn->connected || conn->wrbuf.len || !conn->rcvbuf.len) return;
+    swapbuf(&conn->rcvbuf, &conn->wrbuf);
+    PSC_Connection_sendAsync(conn->sockconn, conn->wrbuf.data,
+	    conn->wrbuf.len, conn);
+}
+
+static void keepbuf(Buffer *buf)
+{
+    if (buf->cap > POOLBUFMAX)
     {
-	PSC_Log_fmt(PSC_L_WARNING, "Protocol: closing unresponsive connection "
-		"with %s", remotestr(self->tcp));
-	PSC_Connection_close(self->tcp, 0);
+	free(buf->data);
+	buf->data = 0;
+	buf->cap = 0;
     }
-    else if (tickno == PINGTICKS)
+    buf->len = 0;
+}
+
+static Connection *newconn(Protocol *self)
+{
+    Connection *conn = Pool_get(self->connpool);
+    Buffer sendq = conn->sendq;
+    Buffer rcvbuf = conn->rcvbuf;
+    Buffer wrbuf = conn->wrbuf;
+    Buffer replay = conn->replay;
+    if (sendq.data || rcvbuf.data || wrbuf.data || replay.data)
     {
-	PSC_Connection_sendAsync(self->tcp, cmdping, 1, 0);
+	++self->bufreused;
     }
+    memset(conn, 0, sizeof *conn);
+    conn->sendq = sendq;
+    conn->rcvbuf = rcvbuf;
+    conn->wrbuf = wrbuf;
+    conn->replay = replay;
+    return conn;
 }
 
-Protocol *Protocol_create(PSC_Connection *tcp, PSC_Server *sockserver,
-	PSC_UnixClientOpts *sockopts)
+static void freebufs(void *ptr)
 {
-    Protocol *self = PSC_malloc(sizeof *self);
-    self->tcp = tcp;
-    self->sockserver = sockserver;
-    self->sockopts = sockopts;
-    self->connections = PSC_HashTable_create(6);
-    self->state = PS_CMD;
-    self->ticks = IDLETICKS;
-    self->nextid = 0;
-    self->cmd = 0;
+    Connection *conn = ptr;
+    free(conn->sendq.data);
+    free(conn->rcvbuf.data);
+    free(conn->wrbuf.data);
+    free(conn->replay.data);
+}
 
-    PSC_Event_register(PSC_Service_tick(), self, tick, 0);
+static void deleteconn(void *ptr)
+{
+    if (!ptr) return;
+    Connection *conn = ptr;
+    unschedule(conn);
+    if (conn->sockconn)
+    {
+	PSC_Event_unregister(PSC_Connection_closed(conn->sockconn), conn,
+		sockclosed, 0);
+	PSC_Connection_close(conn->sockconn, 0);
+    }
+    keepbuf(&conn->sendq);
+    keepbuf(&conn->rcvbuf);
+    keepbuf(&conn->wrbuf);
+    keepbuf(&conn->replay);
+    while (conn->ahead)
+    {
+	Segment *seg = conn->ahead;
+	conn->ahead = seg->next;
+	free(seg);
+    }
+#ifdef WITH_ZSTD
+    ZSTD_freeCCtx(conn->zc);
+    ZSTD_freeDCtx(conn->zd);
+#endif
+    Pool_put(conn->proto->connpool, conn);
+}
 
-    PSC_Event_register(PSC_Connection_dataReceived(tcp), self, received, 0);
-    PSC_Event_register(PSC_Connection_dataSent(tcp), self, sent, 0);
+static void unstall(Connection *conn)
+{
+    conn->stalled = 0;
+    if (!--conn->proto->stalled) PSC_Connection_resume(conn->proto->tcp);
+}
 
-    PSC_Connection_receiveBinary(tcp, 1);
+static void removeconn(Connection *conn)
+{
+    if (conn->stalled) unstall(conn);
+    ChanTable_remove(conn->proto->channels, conn->id);
+    deleteconn(conn);
+}
 
-    if (sockserver)
+static void endconn(Connection *conn)
+{
+    Protocol *self = conn->proto;
+    char sockstr[REMOTESZ];
+    if (conn->sockconn)
     {
-	PSC_Event_register(PSC_Server_clientConnected(sockserver), self,
-		socknewclient, 0);
-	PSC_Server_enable(sockserver);
+	PSC_Log_fmt(PSC_L_DEBUG, "Protocol: disconnected %s <-> %s",
+		remotestr(sockstr, conn->sockconn),
+		remotestr(self->remote, self->tcp));
     }
+    removeconn(conn);
+}
 
-    PSC_Log_fmt(PSC_L_INFO, "Protocol: connected with %s", remotestr(tcp));
-
-    return self;
+static Connection *stripeconn(Protocol *self)
+{
+    Protocol *home = self->bond ? Bond_member(self->bond, self->rxhome) : 0;
+    return home ? ChanTable_get(home->channels, self->cmdid) : 0;
 }
 
-void Protocol_destroy(Protocol *self)
+static int stripein(Connection *conn, uint32_t off, size_t sz)
 {
-    if (!self) return;
+    /* striped data may arrive out of order, but never beyond the window
+     * counted from what wasn't written to the socket yet */
+    uint32_t dist = off - conn->rxpos;
+    if (dist > conn->window || conn->rcvbuf.len + conn->wrbuf.len
+	    + dist + sz > conn->window) return -1;
+
+    Segment *prev = 0;
+    Segment **pos = &conn->ahead;
+    while (*pos && (uint32_t)((*pos)->offset - conn->rxpos) < dist)
+    {
+	prev = *pos;
+	pos = &prev->next;
+    }
+    if (prev && (uint32_t)(prev->offset - conn->rxpos) + prev->len > dist)
+    {
+	return -1;
+    }
+    if (*pos && (uint32_t)((*pos)->offset - conn->rxpos) < dist + sz)
+    {
+	return -1;
+    }
 
-    PSC_Log_fmt(PSC_L_INFO, "Protocol: disconnected from %s",
-	    remotestr(self->tcp));
+    /* in order, so it can go straight to the socket */
+    if (!dist) return 0;
+
+    Segment *seg = PSC_malloc(sizeof *seg + sz);
+    seg->next = *pos;
+    seg->offset = off;
+    seg->len = sz;
+    seg->filled = 0;
+    *pos = seg;
+    return 0;
+}
 
-    PSC_HashTableIterator *i = PSC_HashTable_iterator(self->connections);
-    while (PSC_HashTableIterator_moveNext(i))
+static void reassemble(Connection *conn)
+{
+    Segment *seg;
+    while ((seg = conn->ahead) && seg->offset == conn->rxpos
+	    && seg->filled == seg->len)
     {
-	Connection *conn = PSC_HashTableIterator_current(i);
-	PSC_Connection_close(conn->sockconn, 0);
+	appendbuf(&conn->rcvbuf, seg->data, seg->len);
+	conn->rxpos += seg->len;
+	conn->ahead = seg->next;
+	free(seg);
     }
-    PSC_HashTableIterator_destroy(i);
-    PSC_HashTable_destroy(self->connections);
+}
 
-    if (self->sockserver)
+static void stripedata(Connection *conn, uint32_t off,
+	const uint8_t *data, size_t sz)
+{
+    Segment *seg = conn->ahead;
+    while (seg && (uint32_t)(off - seg->offset) >= seg->len) seg = seg->next;
+    if (seg)
     {
-	PSC_Server_disable(self->sockserver);
-	PSC_Event_unregister(PSC_Server_clientConnected(self->sockserver),
-		self, socknewclient, 0);
+	memcpy(seg->data + (uint32_t)(off - seg->offset), data, sz);
+	seg->filled += sz;
     }
+    else if (off == conn->rxpos)
+    {
+	appendbuf(&conn->rcvbuf, data, sz);
+	conn->rxpos += sz;
+    }
+    else return;
 
-    PSC_Event_unregister(PSC_Service_tick(), self, tick, 0);
+    reassemble(conn);
+    flushsock(conn);
+    if (conn->closing && conn->rxpos == conn->finalpos) endconn(conn);
+}
 
+static void sockconnected(void *receiver, void *sender, void *args)
+{
+    (void)sender;
+    (void)args;
+
+    Connection *conn = receiver;
+    char sockstr[REMOTESZ];
+    PSC_Log_fmt(PSC_L_DEBUG, "Protocol: connected %s <-> %s",
+	    remotestr(sockstr, conn->sockconn),
+	    remotestr(conn->proto->remote, conn->proto->tcp));
+    conn->connected = 1;
+    sendcmd(conn, CMD_CONNECT);
+    flushsock(conn);
+}
+
+static void sockclosed(void *receiver, void *sender, void *args)
+{
+    (void)sender;
+    (void)args;
+
+    Connection *conn = receiver;
+    char sockstr[REMOTESZ];
+    PSC_Log_fmt(PSC_L_DEBUG, "Protocol: disconnected %s <-> %s",
+	    remotestr(sockstr, conn->sockconn),
+	    remotestr(conn->proto->remote, conn->proto->tcp));
+    conn->sockconn = 0;
+    schedule(conn);
+}
+
+static void sockreceived(void *receiver, void *sender, void *args)
+{
+    (void)sender;
+
+    Connection *conn = receiver;
+    PSC_EADataReceived *dra = args;
+    const uint8_t *data = PSC_EADataReceived_buf(dra);
+    size_t sz = PSC_EADataReceived_size(dra);
+
+    /* reads arriving while a TCP write is in progress are merged into a
+     * single frame without any delay, flush() can't write before that one
+     * finished. With a configured delay, small reads are also held for a
+     * bounded time without a write in progress */
+    Protocol *self = conn->proto;
+    size_t coalesce = self->config->coalesce;
+    ++self->reads;
+    if (conn->sendq.len) ++self->merged;
+    appendbuf(&conn->sendq, data, sz);
+    if (conn->sendq.len > (size_t)conn->proto->config->sendqueue)
+    {
+	PSC_Connection_pause(conn->sockconn);
+	conn->paused = 1;
+    }
+    if (conn->queued == &self->held && conn->sendq.len >= coalesce)
+    {
+	/* enough for a frame of a useful size */
+	unschedule(conn);
+    }
+    /* a detached or resuming channel must not wait for the hold timer,
+     * it might be adopted by another tunnel before that expires */
+    if (!conn->queued && self->holdtimer && self->tcp && !conn->resuming
+	    && conn->sendq.len < coalesce && !self->out.len) hold(conn);
+    else schedule(conn);
+}
+
+static void socksent(void *receiver, void *sender, void *args)
+{
+    (void)sender;
+    (void)args;
+
+    Connection *conn = receiver;
+    conn->consumed += conn->wrbuf.len;
+    if (conn->rewind) sendresume(conn);
+    else if (conn->windowed) sendwindow(conn, conn->wrbuf.len);
+    conn->wrbuf.len = 0;
+    flushsock(conn);
+    if (conn->stalled && conn->rcvbuf.len + conn->wrbuf.len <= CHANWINDOW)
+    {
+	unstall(conn);
+    }
+}
+
+static void writeout(Protocol *self)
+{
+    swapbuf(&self->outq, &self->out);
+    if (self->pingbuf == &self->outq)
+    {
+	self->pingbuf = 0;
+	self->pingwrite = self;
+    }
+    self->outsince = self->outqsince;
+    self->txbytes += self->out.len;
+    self->frames += self->outframes;
+    ++self->flushes;
+    self->outframes = 0;
+    PSC_Connection_sendAsync(self->tcp, self->out.data, self->out.len, self);
+}
+
+static void flush(void *receiver, void *sender, void *args)
+{
+    (void)sender;
+    (void)args;
+
+    Protocol *self = receiver;
+    if (!self->tcp) return;
+    if (self->ctlq.len && !self->out.len)
+    {
+	/* control frames go first, outq may hold data striped here by
+	 * other tunnels of a bond */
+	if (!self->outq.len) self->outqsince = Latency_now();
+	appendbuf(&self->ctlq, self->outq.data, self->outq.len);
+	swapbuf(&self->ctlq, &self->outq);
+	if (self->pingbuf == &self->ctlq) self->pingbuf = &self->outq;
+	self->outframes += self->ctlframes;
+	self->ctlq.len = 0;
+	self->ctlframes = 0;
+    }
+    else if (self->ctlq.len && !self->ctlout.len)
+    {
+	/* don't wait for the data write in progress */
+	swapbuf(&self->ctlq, &self->ctlout);
+	if (self->pingbuf == &self->ctlq)
+	{
+	    self->pingbuf = 0;
+	    self->pingwrite = &self->ctlout;
+	}
+	self->txbytes += self->ctlout.len;
+	self->frames += self->ctlframes;
+	++self->flushes;
+	self->ctlframes = 0;
+	PSC_Connection_sendAsync(self->tcp, self->ctlout.data,
+		self->ctlout.len, &self->ctlout);
+    }
+    /* in a bond, striped data may go through other tunnels while this
+     * one is still writing */
+    if (self->out.len && !self->bond) return;
+
+    /* deficit round robin, a channel may send up to a quantum per round
+     * while others are waiting. Channels becoming active are served
+     * first, they join the bulk ones after using up their quantum */
+    Connection *conn;
+    while ((conn = self->sparse.first ? self->sparse.first
+		: self->bulk.first) && self->outq.len < MAXFLUSH)
+    {
+	unschedule(conn);
+	size_t maxsz = MAXFLUSH - self->outq.len;
+	if (!conn->deficit) conn->deficit = QUANTUM;
+	if ((self->sparse.first || self->bulk.first) && maxsz > conn->deficit)
+	{
+	    maxsz = conn->deficit;
+	}
+	size_t sz = senddata(conn, maxsz);
+	conn->deficit = sz < conn->deficit ? conn->deficit - sz : 0;
+	if (!conn->sendq.len)
+	{
+	    conn->deficit = 0;
+	    conn->bulk = 0;
+	}
+	else if (!conn->deficit) conn->bulk = 1;
+	if (conn->sockconn)
+	{
+	    if (conn->paused && conn->sendq.len
+		    <= (size_t)self->config->sendqueue)
+	    {
+		PSC_Connection_resume(conn->sockconn);
+		conn->paused = 0;
+	    }
+	    schedule(conn);
+	}
+	else if (!conn->sendq.len)
+	{
+	    sendcmd(conn, CMD_BYE);
+	    removeconn(conn);
+	}
+	else schedule(conn);
+    }
+
+    /* frames queued from now on use the negotiated format, so control
+     * frames can't overtake any frame in the format used before */
+    if (self->negst == NS_DONE) self->bypass = 1;
+    if (self->bond) for (unsigned i = 0; i < BOND_MAXMEMBERS; ++i)
+    {
+	/* other tunnels of the bond might have been flushed already */
+	Protocol *member = Bond_member(self->bond, i);
+	if (member && member != self && member->outq.len
+		&& !member->out.len) writeout(member);
+    }
+    if (self->outq.len && !self->out.len) writeout(self);
+}
+
+static int addconnection(Protocol *self, uint32_t id, PSC_Connection *sockconn)
+{
+    uint16_t feat = self->tunnels ? self->sendfeat : self->recvfeat;
+    Connection *conn = newconn(self);
+
+    if (self->tunnels)
+    {
+	/* peers without FRAMEV2 may use the raw bytes of a channel id as a
+	 * string key, so an id with a zero low byte must never be used */
+	int v2 = !!(feat & FEAT_FRAMEV2);
+	if (ChanTable_alloc(self->channels, v2 ? CHANTABLE_MAXID : UINT16_MAX,
+		    !v2, conn, &id) < 0) goto fail;
+    }
+    else if (ChanTable_set(self->channels, id, conn) < 0) goto fail;
+
+    conn->proto = self;
+    conn->window = (feat & FEAT_FRAMEV2) ? BULKWINDOW : CHANWINDOW;
+    conn->credit = conn->window;
+    conn->windowed = !!(feat & FEAT_WINDOW);
+    conn->early = conn->windowed && (feat & FEAT_EARLYDATA);
+    conn->resumable = conn->windowed && (feat & FEAT_RESUME);
+    conn->id = id;
+#ifdef WITH_ZSTD
+    conn->compress = conn->windowed && (feat & FEAT_COMPRESS);
+#endif
+
+    if (self->tunnels)
+    {
+	conn->sockconn = sockconn;
+	conn->opened = Latency_now();
+	/* with early data, the peer buffers what we send until its socket
+	 * is connected, otherwise wait for CONNECT before reading */
+	if (!conn->early) PSC_Connection_pause(sockconn);
+	sendcmd(conn, CMD_HELLO);
+    }
+    else
+    {
+	conn->sockconn = PSC_Connection_createUnixClient(self->sockopts);
+	if (!conn->sockconn)
+	{
+	    schedule(conn);
+	    return 0;
+	}
+	PSC_Event_register(PSC_Connection_connected(conn->sockconn), conn,
+		sockconnected, 0);
+    }
+    if (conn->resumable)
+    {
+	/* both windows were announced with the session */
+	conn->window = self->window;
+	conn->credit = self->peerwin;
+    }
+    else if (conn->windowed && (size_t)self->config->window > conn->window)
+    {
+	/* the initial window is implied by the protocol, grant the
+	 * configured excess explicitly */
+	sendwindow(conn, self->config->window - conn->window);
+	conn->window = self->config->window;
+    }
+    PSC_Event_register(PSC_Connection_closed(conn->sockconn), conn,
+	    sockclosed, 0);
+    PSC_Event_register(PSC_Connection_dataReceived(conn->sockconn), conn,
+	    sockreceived, 0);
+    PSC_Event_register(PSC_Connection_dataSent(conn->sockconn), conn,
+	    socksent, 0);
+    return 0;
+
+fail:
+    Pool_put(self->connpool, conn);
+    return -1;
+}
+
+static void ready(Protocol *self)
+{
+    /* only take socket connections once it's clear whether a session is
+     * resumed, its channel ids are in use, and whether the tunnel is part
+     * of a bond */
+    if (!self->tunnels || self->listed) return;
+    Tunnels_add(self->tunnels, self);
+    self->listed = 1;
+}
+
+static void adoptconn(void *obj, void *arg)
+{
+    /* the lists a channel is queued in belong to the old tunnel */
+    Connection *conn = obj;
+    unschedule(conn);
+    conn->proto = arg;
+}
+
+static void resumeconn(void *obj, void *arg)
+{
+    (void)arg;
+
+    Connection *conn = obj;
+    if (!conn->proto->tunnels && conn->connected && conn->sockconn)
+    {
+	/* CONNECT might have been lost, the peer ignores a repeated one */
+	sendcmd(conn, CMD_CONNECT);
+    }
+    /* what the socket consumes is acknowledged with RESUME, so wait for a
+     * write in progress */
+    if (conn->wrbuf.len) conn->rewind = 1;
+    else sendresume(conn);
+}
+
+static void detachconn(void *obj, void *arg)
+{
+    (void)arg;
+
+    /* nothing is sent before the peer tells where to continue */
+    Connection *conn = obj;
+    unschedule(conn);
+    conn->credit = 0;
+    conn->resuming = 1;
+}
+
+static void adopt(Protocol *self, Protocol *old)
+{
+    ChanTable *channels = self->channels;
+    Pool *connpool = self->connpool;
+    self->channels = old->channels;
+    self->connpool = old->connpool;
+    old->channels = channels;
+    old->connpool = connpool;
+    old->tokenref = 0;
+    ChanTable_foreach(self->channels, adoptconn, self);
+    Protocol_destroy(old);
+
+    PSC_Log_fmt(PSC_L_INFO, "Protocol: resumed session with %s, "
+	    "%zu socket connections", remotestr(self->remote, self->tcp),
+	    ChanTable_count(self->channels));
+    if (self->stats) Stats_countResume(self->stats);
+    ChanTable_foreach(self->channels, resumeconn, 0);
+}
+
+static int session(Protocol *self, const uint8_t *token, uint32_t window)
+{
+    if (!window) return -1;
+    Protocol *old = 0;
+    if (self->tcpclient)
+    {
+	/* the server either confirms our token or assigns a new one */
+	if (self->session != SS_REQUESTED) return -1;
+	if (!memcmp(token, notoken, SESSION_TOKENSZ)) return -1;
+	if (self->tokenref) old = Sessions_find(self->sessions, self->tokenref);
+	if (old && memcmp(old->token, token, SESSION_TOKENSZ))
+	{
+	    PSC_Log_fmt(PSC_L_INFO, "Protocol: session with %s is gone, "
+		    "closing %zu socket connections", remotestr(old->remote, 0),
+		    ChanTable_count(old->channels));
+	    Protocol_destroy(old);
+	    old = 0;
+	}
+	memcpy(self->token, token, SESSION_TOKENSZ);
+    }
+    else
+    {
+	if (self->session != SS_NONE) return -1;
+	old = Sessions_find(self->sessions, token);
+	if (old && old->tcp)
+	{
+	    /* the client lost the old connection before we noticed, the
+	     * token is only known to the client, so close that one, the
+	     * connection detaches the session when dropping it */
+	    PSC_Log_fmt(PSC_L_INFO, "Protocol: %s resumes a session still "
+		    "connected with %s", remotestr(self->remote, self->tcp),
+		    remotestr(old->remote, old->tcp));
+	    PSC_Connection *tcp = old->tcp;
+	    PSC_Connection_setData(tcp, 0, 0);
+	    PSC_Connection_close(tcp, 0);
+	    old = Sessions_find(self->sessions, token);
+	}
+	if (old && ChanTable_count(self->channels))
+	{
+	    Protocol_destroy(old);
+	    old = 0;
+	}
+	if (old) memcpy(self->token, token, SESSION_TOKENSZ);
+	else Sessions_newToken(self->sessions, self->token);
+	sendext(self, CMD_SESSION, 0, self->window,
+		self->token, SESSION_TOKENSZ);
+    }
+
+    self->peerwin = window;
+    self->session = SS_DONE;
+    Sessions_add(self->sessions, self, self->token);
+    if (self->tokenref) memcpy(self->tokenref, self->token, SESSION_TOKENSZ);
+    if (old) adopt(self, old);
+    ready(self);
+    return 0;
+}
+
+static int resume(Protocol *self, Connection *conn, uint32_t pos)
+{
+    if (!conn)
+    {
+	/* closed here before the session was resumed */
+	sendhdr(self, CMD_BYE, self->cmdid, 0);
+	return 0;
+    }
+    /* a channel opened again with the same id after the peer lost it */
+    if (!conn->resuming) return 0;
+
+    uint32_t acked = pos - conn->acked;
+    if (acked > conn->replay.len - conn->replayoff) return -1;
+    conn->replayoff += acked;
+    conn->acked = pos;
+
+    /* send everything not acknowledged again, before the queued data */
+    consumebuf(&conn->replay, conn->replayoff);
+    conn->replayoff = 0;
+    appendbuf(&conn->replay, conn->sendq.data, conn->sendq.len);
+    swapbuf(&conn->replay, &conn->sendq);
+    conn->replay.len = 0;
+    conn->credit = self->peerwin;
+    conn->resuming = 0;
+#ifdef WITH_ZSTD
+    if (conn->zc) ZSTD_CCtx_reset(conn->zc, ZSTD_reset_session_only);
+#endif
+    schedule(conn);
+    return 0;
+}
+
+static int join(Protocol *self, uint32_t index, const uint8_t *id)
+{
+    if (self->tcpclient || self->bond) return -1;
+    self->bond = Bonds_join(self->bonds, id, index, self);
+    if (!self->bond)
+    {
+	/* the tunnel this one replaces might still be around, it must be
+	 * gone first, so no striped data is mixed up */
+	PSC_Log_fmt(PSC_L_INFO, "Protocol: %s can't join its bond as "
+		"tunnel %u", remotestr(self->remote, self->tcp),
+		(unsigned)index);
+	return -1;
+    }
+    self->member = index;
+    ready(self);
+    return 0;
+}
+
+static void dropconn(void *obj, void *arg)
+{
+    (void)arg;
+
+    Connection *conn = obj;
+    sendcmd(conn, CMD_BYE);
+    removeconn(conn);
+}
+
+static void unbond(Protocol *self)
+{
+    Bond *bond = self->bond;
+    if (!bond) return;
+    self->bond = 0;
+
+    /* striped data of any socket connection might be lost with this
+     * tunnel, so close them on all the others */
+    for (unsigned i = 0; i < BOND_MAXMEMBERS; ++i)
+    {
+	Protocol *member = Bond_member(bond, i);
+	if (!member || member == self) continue;
+	if (ChanTable_count(member->channels))
+	{
+	    PSC_Log_fmt(PSC_L_INFO, "Protocol: lost a bonded tunnel, "
+		    "closing %zu socket connections with %s",
+		    ChanTable_count(member->channels),
+		    remotestr(member->remote, member->tcp));
+	}
+	ChanTable_foreach(member->channels, dropconn, 0);
+    }
+    Bond_leave(bond, self);
+}
+
+static void sent(void *receiver, void *sender, void *args)
+{
+    (void)sender;
+
+    Protocol *self = receiver;
+    if (args == self->pingwrite)
+    {
+	/* the PING waited behind our own queued output, so only start
+	 * waiting for an answer now */
+	self->pingwrite = 0;
+	if (self->deadline) startdeadline(self, deadms(self));
+    }
+    if (args == &self->ctlout)
+    {
+	self->ctlout.len = 0;
+	return;
+    }
+    self->out.len = 0;
+    Latency_add(self->outwait, Latency_now() - self->outsince);
+}
+
+static void received(void *receiver, void *sender, void *args)
+{
+    (void)sender;
+
+    PSC_EADataReceived *dra = args;
+    receive(receiver, PSC_EADataReceived_buf(dra),
+	    PSC_EADataReceived_size(dra));
+}
+
+static void receive(Protocol *self, const uint8_t *buf, size_t sz)
+{
+    self->idle = 0;
+    self->rxbytes += sz;
+
+    /* decode all frames available, only a header split across reads is
+     * copied, payloads are passed on straight from the read buffer */
+    while (sz)
+    {
+	const uint8_t *hdr = buf;
+	size_t n = 1;
+	int rc = 0;
+
+	switch (self->state)
+	{
+	    case PS_CMD:
+		rc = command(self, buf[0]);
+		break;
+
+	    case PS_HDR:
+	    case PS_IDENT:
+		n = self->hdrsz - self->hdrlen;
+		if (self->hdrlen || sz < n)
+		{
+		    if (n > sz) n = sz;
+		    memcpy(self->hdr + self->hdrlen, buf, n);
+		    self->hdrlen += n;
+		    if (self->hdrlen < self->hdrsz) break;
+		    hdr = self->hdr;
+		}
+		self->hdrlen = 0;
+		rc = self->state == PS_HDR ?
+		    header(self, hdr) : ident(self, hdr);
+		break;
+
+	    case PS_DATA:
+		n = self->remaining < sz ? self->remaining : sz;
+		rc = payload(self, buf, n);
+		break;
+	}
+
+	if (rc < 0) goto error;
+	buf += n;
+	sz -= n;
+    }
+    return;
+
+error:
+    PSC_Log_fmt(PSC_L_WARNING, "Protocol: unexpected data from %s, "
+	    "closing connection", remotestr(self->remote, self->tcp));
+    if (self->stats) Stats_countReset(self->stats);
+    self->session = SS_NONE;
+    switch (self->state)
+    {
+	case PS_CMD:
+	    PSC_Log_fmt(PSC_L_DEBUG, "Protocol: unknown command 0x%02hhx",
+		    buf[0]);
+	    break;
+
+	case PS_HDR:
+	    PSC_Log_fmt(PSC_L_DEBUG, "Protocol: unexpected command 0x%02hhx "
+		    "for client %u", self->cmd, (unsigned)self->cmdid);
+	    break;
+
+	case PS_DATA:
+	    PSC_Log_fmt(PSC_L_DEBUG, "Protocol: invalid compressed data "
+		    "for client %u", (unsigned)self->cmdid);
+	    break;
+
+	case PS_IDENT:
+	    PSC_Log_msg(PSC_L_DEBUG,
+		    "Protocol: unexpected feature negotiation");
+	    break;
+
+	default:
+	    break;
+    }
+    PSC_Connection_close(self->tcp, 0);
+}
+
+static int command(Protocol *self, uint8_t byte)
+{
+    ++self->rxframes;
+    self->cmd = byte;
+    if (self->negst == NS_START)
+    {
+	if (self->cmd == CMD_PONG)
+	{
+	    self->negst = NS_OFFER;
+	    sendident(self, self->features);
+	    return 0;
+	}
+	self->negst = NS_DONE;
+	ready(self);
+    }
+    if (self->recvfeat & FEAT_FRAMEV2)
+    {
+	if ((byte >> 4) >= sizeof v2cmds) return -1;
+	self->cmd = v2cmds[byte >> 4];
+	self->idsz = hasid(self->cmd) ? (byte >> 2 & 3) + 1 : 0;
+	self->argsz = hasarg(self->cmd, self->recvfeat) ? (byte & 3) + 1 : 0;
+    }
+    else
+    {
+	self->idsz = hasid(self->cmd) ? 2 : 0;
+	self->argsz = hasarg(self->cmd, self->recvfeat) ?
+	    v1argsz(self->cmd) : 0;
+    }
+    switch (self->cmd)
+    {
+	case CMD_PING:
+	case CMD_PONG:
+	    if (self->argsz)
+	    {
+		self->state = PS_HDR;
+		self->hdrsz = self->argsz;
+	    }
+	    else if (self->cmd == CMD_PING)
+	    {
+		sendhdr(self, CMD_PONG, 0, 0);
+	    }
+	    else pong(self, 0);
+	    return 0;
+
+	case CMD_IDENT:
+	    self->state = PS_IDENT;
+	    self->hdrsz = 2;
+	    return 0;
+
+	case CMD_SESSION:
+	case CMD_RESUME:
+	    if (!(self->recvfeat & FEAT_RESUME)) return -1;
+	    self->state = PS_HDR;
+	    self->hdrsz = self->idsz + self->argsz;
+	    /* the token follows the window */
+	    if (self->cmd == CMD_SESSION) self->hdrsz += SESSION_TOKENSZ;
+	    return 0;
+
+	case CMD_JOIN:
+	case CMD_SDATA:
+	    if (!(self->recvfeat & FEAT_BOND)) return -1;
+	    self->state = PS_HDR;
+	    /* the bond id follows the tunnel number, the home tunnel and
+	     * position follow the length of striped data */
+	    self->hdrsz = self->idsz + self->argsz
+		+ (self->cmd == CMD_JOIN ? BOND_IDSZ : STRIPEEXT);
+	    return 0;
+
+	case CMD_ZDATA:
+	    if (!(self->recvfeat & FEAT_COMPRESS)) return -1;
+	    /* fall through */
+	case CMD_WINDOW:
+	    if (!(self->recvfeat & FEAT_WINDOW)) return -1;
+	    /* fall through */
+	case CMD_HELLO:
+	case CMD_CONNECT:
+	case CMD_BYE:
+	case CMD_DATA:
+	    self->state = PS_HDR;
+	    self->hdrsz = self->idsz + self->argsz;
+	    return 0;
+
+	default:
+	    return -1;
+    }
+}
+
+static int header(Protocol *self, const uint8_t *hdr)
+{
+    self->cmdid = getfield(hdr, self->idsz);
+    uint32_t arg = getfield(hdr + self->idsz, self->argsz);
+    Connection *conn = ChanTable_get(self->channels, self->cmdid);
+    char sockstr[REMOTESZ];
+
+    switch (self->cmd)
+    {
+	case CMD_PING:
+	    sendhdr(self, CMD_PONG, 0, arg);
+	    break;
+
+	case CMD_PONG:
+	    pong(self, arg);
+	    break;
+
+	case CMD_HELLO:
+	    if (self->tunnels) return -1;
+	    if ((self->recvfeat & FEAT_RESUME) && self->session != SS_DONE)
+	    {
+		return -1;
+	    }
+	    /* the peer lost this channel before the session was resumed */
+	    if (conn && conn->resuming) removeconn(conn);
+	    if (addconnection(self, self->cmdid, 0) < 0) return -1;
+	    break;
+
+	case CMD_CONNECT:
+	    if (!self->tunnels) return -1;
+	    if (!conn || !conn->sockconn || conn->connected) break;
+	    conn->connected = 1;
+	    Latency_add(self->connect, Latency_now() - conn->opened);
+	    if (!conn->early) PSC_Connection_resume(conn->sockconn);
+	    PSC_Log_fmt(PSC_L_DEBUG, "Protocol: connected %s <-> %s",
+		    remotestr(sockstr, conn->sockconn),
+		    remotestr(self->remote, self->tcp));
+	    break;
+
+	case CMD_BYE:
+	    /* both sides may send BYE at the same time, e.g. when they lose
+	     * a tunnel of their bond */
+	    if (!conn) break;
+	    if (self->bond && conn->sockconn && arg != conn->rxpos)
+	    {
+		/* striped data is still on its way through other tunnels */
+		conn->closing = 1;
+		conn->finalpos = arg;
+		break;
+	    }
+	    endconn(conn);
+	    break;
+
+	case CMD_WINDOW:
+	    if (conn && conn->windowed)
+	    {
+		if (conn->resumable)
+		{
+		    /* without grants, WINDOW acknowledges data */
+		    if (arg > conn->replay.len - conn->replayoff) return -1;
+		    conn->replayoff += arg;
+		    conn->acked += arg;
+		}
+		conn->credit += arg;
+		schedule(conn);
+	    }
+	    break;
+
+	case CMD_ZDATA:
+	case CMD_DATA:
+	    if (arg > MAXFRAME) return -1;
+	    if (conn && self->cmd == CMD_DATA)
+	    {
+		if (conn->windowed && conn->rcvbuf.len
+			+ conn->wrbuf.len + arg > conn->window)
+		{
+		    return -1;
+		}
+#ifdef WITH_ZSTD
+		/* the sender starts a new zstd frame after plain data */
+		if (conn->zd) ZSTD_DCtx_reset(conn->zd,
+			ZSTD_reset_session_only);
+#endif
+	    }
+#ifdef WITH_ZSTD
+	    else if (conn && !conn->compress) return -1;
+#endif
+	    if (conn)
+	    {
+		++conn->stats.rxframes;
+		conn->stats.rxbytes += arg;
+	    }
+	    if (!arg) break;
+	    /* data for a channel already closed here is skipped */
+	    self->remaining = arg;
+	    self->state = PS_DATA;
+	    return 0;
+
+	case CMD_SESSION:
+	    if (session(self, hdr + self->argsz, arg) < 0) return -1;
+	    break;
+
+	case CMD_RESUME:
+	    if (resume(self, conn, arg) < 0) return -1;
+	    break;
+
+	case CMD_JOIN:
+	    if (join(self, arg, hdr + self->argsz) < 0) return -1;
+	    break;
+
+	case CMD_SDATA:
+	    if (arg > MAXFRAME) return -1;
+	    self->rxhome = hdr[self->idsz + self->argsz];
+	    self->rxoff = getfield(hdr + self->idsz + self->argsz + 1, 4);
+	    conn = stripeconn(self);
+	    if (conn)
+	    {
+		++conn->stats.rxframes;
+		conn->stats.rxbytes += arg;
+	    }
+	    if (!arg) break;
+	    if (conn && conn->sockconn && stripein(conn, self->rxoff, arg) < 0)
+	    {
+		return -1;
+	    }
+	    self->remaining = arg;
+	    self->state = PS_DATA;
+	    return 0;
+
+	default:
+	    return -1;
+    }
+    self->state = PS_CMD;
+    return 0;
+}
+
+static int payload(Protocol *self, const uint8_t *data, size_t sz)
+{
+    if (self->cmd == CMD_SDATA)
+    {
+	Connection *conn = stripeconn(self);
+	if (conn && conn->sockconn) stripedata(conn, self->rxoff, data, sz);
+	self->rxoff += sz;
+	if (!(self->remaining -= sz)) self->state = PS_CMD;
+	return 0;
+    }
+
+    Connection *conn = ChanTable_get(self->channels, self->cmdid);
+    if (conn && conn->sockconn)
+    {
+	size_t len = conn->rcvbuf.len;
+#ifdef WITH_ZSTD
+	if (self->cmd == CMD_ZDATA)
+	{
+	    if (inflatedata(conn, data, sz) < 0) return -1;
+	}
+	else appendbuf(&conn->rcvbuf, data, sz);
+#else
+	appendbuf(&conn->rcvbuf, data, sz);
+#endif
+	/* data not striped comes first, striped data already received
+	 * may follow it */
+	conn->rxpos += conn->rcvbuf.len - len;
+	if (conn->ahead) reassemble(conn);
+	flushsock(conn);
+	/* without a window, the only way to slow down the peer is to stop
+	 * reading from TCP */
+	if (!conn->windowed && !conn->stalled
+		&& conn->rcvbuf.len + conn->wrbuf.len > CHANWINDOW)
+	{
+	    conn->stalled = 1;
+	    if (!self->stalled++) PSC_Connection_pause(self->tcp);
+	}
+    }
+    if (!(self->remaining -= sz)) self->state = PS_CMD;
+    return 0;
+}
+
+static int ident(Protocol *self, const uint8_t *data)
+{
+    uint16_t features = data[0] << 8 | data[1];
+    switch (self->negst)
+    {
+	case NS_OFFER:
+	    if (self->tcpclient)
+	    {
+		self->features &= features;
+		/* striping needs flow control to bound the reordering */
+		if (!(self->features & FEAT_WINDOW))
+		{
+		    self->features &= ~FEAT_BOND;
+		}
+		sendfeatures(self);
+		self->negst = NS_CONFIRM;
+	    }
+	    else
+	    {
+		if (features & ~self->features) return -1;
+		if ((features & FEAT_BOND) && !(features & FEAT_WINDOW))
+		{
+		    return -1;
+		}
+		self->features = features;
+		self->recvfeat = features;
+		sendfeatures(self);
+		self->negst = NS_DONE;
+		/* with resumption, the client requests a session first, with
+		 * bonding, it joins its bond first */
+		if (!(features & (FEAT_RESUME|FEAT_BOND))) ready(self);
+		PSC_Log_fmt(PSC_L_DEBUG, "Protocol: negotiated features "
+			"0x%04x with %s", (unsigned)features,
+			remotestr(self->remote, self->tcp));
+	    }
+	    break;
+
+	case NS_CONFIRM:
+	    if (features != self->features) return -1;
+	    self->recvfeat = features;
+	    self->negst = NS_DONE;
+	    if (features & FEAT_RESUME)
+	    {
+		sendext(self, CMD_SESSION, 0, self->window,
+			self->tokenref ? self->tokenref : notoken,
+			SESSION_TOKENSZ);
+		self->session = SS_REQUESTED;
+	    }
+	    else if (features & FEAT_BOND)
+	    {
+		self->bond = Bonds_join(self->bonds, self->bondref,
+			self->member, self);
+		if (!self->bond) return -1;
+		sendext(self, CMD_JOIN, 0, self->member,
+			self->bondref, BOND_IDSZ);
+		ready(self);
+	    }
+	    else ready(self);
+	    PSC_Log_fmt(PSC_L_DEBUG, "Protocol: negotiated features "
+		    "0x%04x with %s", (unsigned)features,
+		    remotestr(self->remote, self->tcp));
+	    break;
+
+	default:
+	    return -1;
+    }
+    self->state = PS_CMD;
+    return 0;
+}
+
+static void addstats(void *obj, void *arg)
+{
+    Connection *conn = obj;
+    ProtocolStats *stats = arg;
+
+    stats->queued += conn->sendq.len;
+    if (conn->paused) ++stats->paused;
+    if (conn->sendq.len && conn->windowed && !conn->credit) ++stats->blocked;
+}
+
+static void chanreport(void *obj, void *arg)
+{
+    Connection *conn = obj;
+    ChanReport *cr = arg;
+
+    conn->stats.queued = conn->sendq.len;
+    conn->stats.credit = conn->windowed ? conn->credit : 0;
+    conn->stats.id = conn->id;
+    conn->stats.paused = conn->paused;
+    conn->stats.blocked = conn->sendq.len && conn->windowed && !conn->credit;
+    cr->report(cr->arg, &conn->stats);
+}
+
+static unsigned pingms(const Protocol *self)
+{
+    /* ask for a sign of life after a few round trips of silence */
+    if (!Latency_count(self->rtt)) return PINGMS;
+    uint64_t ms = 4 * Latency_percentile(self->rtt, 99.0) / 1000;
+    if (ms < MINPINGMS) return MINPINGMS;
+    if (ms > PINGMS) return PINGMS;
+    return ms;
+}
+
+static unsigned deadms(const Protocol *self)
+{
+    /* a peer without flow control stops reading while one of its sockets
+     * is slow, so it can't be expected to answer in time */
+    if (!(self->recvfeat & FEAT_WINDOW) || !Latency_count(self->rtt))
+    {
+	return IDLEMS;
+    }
+
+    /* a live peer answers within its round-trip time, allow for a lot of
+     * jitter and a retransmission on top */
+    uint64_t ms = MINDEADMS + 4 * Latency_percentile(self->rtt, 99.0) / 1000;
+    if (ms > IDLEMS) return IDLEMS;
+    return ms;
+}
+
+static void watch(Protocol *self)
+{
+    self->deadline = 0;
+    self->idle = 1;
+    PSC_Timer_setMs(self->timer, pingms(self));
+    PSC_Timer_start(self->timer, 1);
+}
+
+static void startdeadline(Protocol *self, unsigned ms)
+{
+    self->deadline = 1;
+    self->idle = 1;
+    PSC_Timer_setMs(self->timer, ms);
+    PSC_Timer_start(self->timer, 0);
+}
+
+static void expired(void *receiver, void *sender, void *args)
+{
+    (void)sender;
+    (void)args;
+
+    Protocol *self = receiver;
+
+    if (!self->idle)
+    {
+	/* received something since the last check */
+	if (self->deadline) watch(self);
+	else self->idle = 1;
+	return;
+    }
+
+    /* while we don't read from TCP ourselves, nothing can arrive */
+    if (self->stalled)
+    {
+	if (self->deadline) PSC_Timer_start(self->timer, 0);
+	return;
+    }
+
+    if (self->deadline)
+    {
+	PSC_Log_fmt(PSC_L_WARNING, "Protocol: closing unresponsive connection "
+		"with %s", remotestr(self->remote, self->tcp));
+	PSC_Connection_close(self->tcp, 0);
+	return;
+    }
+
+    /* A client not negotiating by now won't do so later */
+    if (self->negst == NS_START) self->negst = NS_DONE;
+    if (!self->pingbuf && !self->pingwrite)
+    {
+	if (self->pingsent && !(self->sendfeat & FEAT_TIMESTAMP))
+	{
+	    /* the PING already written wasn't answered yet */
+	    startdeadline(self, deadms(self));
+	    return;
+	}
+	sendping(self);
+	self->rttticks = RTTTICKS;
+    }
+
+    /* the answer is awaited once the PING is written, don't wait forever
+     * for that either */
+    startdeadline(self, IDLEMS);
+}
+
+static void tick(void *receiver, void *sender, void *args)
+{
+    (void)sender;
+    (void)args;
+
+    Protocol *self = receiver;
+
+    if (!self->tcp)
+    {
+	if (!--self->ticks)
+	{
+	    PSC_Log_fmt(PSC_L_INFO, "Protocol: session with %s expired, "
+		    "closing %zu socket connections", remotestr(self->remote, 0),
+		    ChanTable_count(self->channels));
+	    Protocol_destroy(self);
+	}
+	return;
+    }
+
+    if (self->sessticks && !--self->sessticks
+	    && self->negst == (self->tcpclient ? NS_OFFER : NS_START))
+    {
+	/* no feature negotiation yet, probably an older peer, so don't let
+	 * socket connections wait for a session or bond any longer */
+	self->features &= ~(FEAT_RESUME|FEAT_BOND);
+	ready(self);
+    }
+
+    if ((self->sendfeat & FEAT_TIMESTAMP) && !--self->rttticks)
+    {
+	/* measure the round-trip time also while the connection is busy */
+	sendping(self);
+	self->rttticks = RTTTICKS;
+    }
+}
+
+Protocol *Protocol_create(PSC_Connection *tcp, Tunnels *tunnels,
+	PSC_UnixClientOpts *sockopts, Sessions *sessions, Bonds *bonds,
+	Stats *stats, const Config *config, int tcpclient)
+{
+    Protocol *self = PSC_malloc(sizeof *self);
+    self->config = config;
+    self->tcp = tcp;
+    self->tunnels = tunnels;
+    self->sessions = config->resume ? sessions : 0;
+    self->bonds = config->bond ? bonds : 0;
+    self->stats = stats;
+    self->bond = 0;
+    self->bondref = 0;
+    self->sockopts = sockopts;
+    self->channels = ChanTable_create();
+    self->connpool = Pool_create(sizeof(Connection), SLABCONNS);
+    memset(&self->sparse, 0, sizeof self->sparse);
+    memset(&self->bulk, 0, sizeof self->bulk);
+    memset(&self->held, 0, sizeof self->held);
+    memset(&self->outq, 0, sizeof self->outq);
+    memset(&self->out, 0, sizeof self->out);
+    memset(&self->ctlq, 0, sizeof self->ctlq);
+    memset(&self->ctlout, 0, sizeof self->ctlout);
+    self->rtt = Latency_create();
+    self->connect = Latency_create();
+    self->outwait = Latency_create();
+    self->outqsince = 0;
+    self->outsince = 0;
+    self->pingsent = 0;
+    self->timer = PSC_Timer_create();
+    self->holdtimer = 0;
+    if (config->delay && config->coalesce)
+    {
+	self->holdtimer = PSC_Timer_create();
+	PSC_Timer_setMs(self->holdtimer, config->delay);
+    }
+    self->pingbuf = 0;
+    self->pingwrite = 0;
+    self->rxbytes = 0;
+    self->rxframes = 0;
+    self->txbytes = 0;
+    self->frames = 0;
+    self->flushes = 0;
+    self->reads = 0;
+    self->merged = 0;
+    self->dataframes = 0;
+    self->bufreused = 0;
+    self->window = (size_t)config->window > BULKWINDOW ?
+	(size_t)config->window : BULKWINDOW;
+    self->peerwin = 0;
+    self->outframes = 0;
+    self->ctlframes = 0;
+    self->remaining = 0;
+    self->hdrsz = 0;
+    self->hdrlen = 0;
+    self->state = PS_CMD;
+    self->negst = tcpclient ? NS_OFFER : NS_START;
+    self->session = SS_NONE;
+    self->stalled = 0;
+    self->bypass = 0;
+    self->listed = 0;
+    self->ticks = 0;
+    self->idle = 0;
+    self->deadline = 0;
+    self->rttticks = RTTTICKS;
+    self->sessticks = (self->sessions || self->bonds) ? IDENTTICKS : 0;
+    self->tcpclient = tcpclient;
+    self->member = 0;
+    self->features = FEATURES;
+    if (self->sessions) self->features |= FEAT_RESUME;
+    if (self->bonds) self->features |= FEAT_BOND;
+#ifdef WITH_ZSTD
+    if (config->compress) self->features |= FEAT_COMPRESS;
+    self->zin = 0;
+    self->zout = 0;
+    memset(&self->zbuf, 0, sizeof self->zbuf);
+#endif
+    self->sendfeat = 0;
+    self->recvfeat = 0;
+    self->tokenref = 0;
+    memset(self->token, 0, sizeof self->token);
+    self->cmdid = 0;
+    self->rxoff = 0;
+    self->rxhome = 0;
+    self->cmd = 0;
+    self->idsz = 0;
+    self->argsz = 0;
+
+    PSC_Event_register(PSC_Service_tick(), self, tick, 0);
+    PSC_Event_register(PSC_Service_eventsDone(), self, flush, 0);
+    PSC_Event_register(PSC_Timer_expired(self->timer), self, expired, 0);
+    if (self->holdtimer)
+    {
+	PSC_Event_register(PSC_Timer_expired(self->holdtimer), self,
+		release, 0);
+    }
+    watch(self);
+
+    PSC_Event_register(PSC_Connection_dataReceived(tcp), self, received, 0);
+    PSC_Event_register(PSC_Connection_dataSent(tcp), self, sent, 0);
+
+    /* A lone PONG is ignored by peers not knowing about features, so use
+     * it to announce we can negotiate them */
+    if (tcpclient) sendhdr(self, CMD_PONG, 0, 0);
+
+    if (!(self->features & (FEAT_RESUME|FEAT_BOND))) ready(self);
+    if (self->stats) Stats_add(self->stats, self);
+
+    PSC_Log_fmt(PSC_L_INFO, "Protocol: connected with %s",
+	    remotestr(self->remote, tcp));
+
+    return self;
+}
+
+void Protocol_bond(Protocol *self, const uint8_t *id, unsigned index)
+{
+    self->bondref = id;
+    self->member = index;
+}
+
+void Protocol_session(Protocol *self, uint8_t *token)
+{
+    self->tokenref = token;
+}
+
+int Protocol_accept(Protocol *self, PSC_Connection *sockconn)
+{
+    return addconnection(self, 0, sockconn);
+}
+
+void Protocol_receive(Protocol *self, const uint8_t *data, size_t sz)
+{
+    receive(self, data, sz);
+}
+
+size_t Protocol_load(const Protocol *self)
+{
+    return ChanTable_count(self->channels);
+}
+
+const Latency *Protocol_rtt(const Protocol *self)
+{
+    return self->rtt;
+}
+
+void Protocol_stats(Protocol *self, ProtocolStats *stats)
+{
+    memset(stats, 0, sizeof *stats);
+    stats->remote = remotestr(self->remote, self->tcp);
+    stats->rxbytes = self->rxbytes;
+    stats->rxframes = self->rxframes;
+    stats->txbytes = self->txbytes;
+    stats->txframes = self->frames;
+    stats->writes = self->flushes;
+    stats->reads = self->reads;
+    stats->merged = self->merged;
+    stats->dataframes = self->dataframes;
+#ifdef WITH_ZSTD
+    stats->zin = self->zin;
+    stats->zout = self->zout;
+#endif
+    stats->channels = ChanTable_count(self->channels);
+    stats->opened = Pool_stats(self->connpool)->allocs;
+    stats->queued = self->outq.len + self->out.len
+	+ self->ctlq.len + self->ctlout.len;
+    stats->rtt = self->rtt;
+    stats->connect = self->connect;
+    stats->outwait = self->outwait;
+    stats->features = self->recvfeat;
+    ChanTable_foreach(self->channels, addstats, stats);
+}
+
+void Protocol_channelStats(Protocol *self,
+	void (*report)(void *arg, const ChannelStats *stats), void *arg)
+{
+    ChanReport cr = { report, arg };
+    ChanTable_foreach(self->channels, chanreport, &cr);
+}
+
+static void logclosed(Protocol *self)
+{
+    PSC_Log_fmt(PSC_L_INFO, "Protocol: disconnected from %s",
+	    remotestr(self->remote, self->tcp));
+    if (self->flushes)
+    {
+	PSC_Log_fmt(PSC_L_DEBUG, "Protocol: sent %llu frames in %llu writes "
+		"(%.2f frames per write)", self->frames, self->flushes,
+		(double)self->frames / self->flushes);
+    }
+#ifdef WITH_ZSTD
+    if (self->zin)
+    {
+	PSC_Log_fmt(PSC_L_DEBUG, "Protocol: compressed %llu bytes to %llu "
+		"(%.1f%%)", self->zin, self->zout,
+		100.0 * self->zout / self->zin);
+    }
+#endif
+
+    const PoolStats *ps = Pool_stats(self->connpool);
+    if (ps->allocs)
+    {
+	PSC_Log_fmt(PSC_L_DEBUG, "Protocol: %zu channels, %.1f%% from pool "
+		"(%zu with buffers), at most %zu open", ps->allocs,
+		100.0 * ps->reused / ps->allocs, self->bufreused,
+		ps->highwater);
+    }
+}
+
+void Protocol_detach(Protocol *self)
+{
+    if (!self) return;
+
+    if (!self->sessions || self->session != SS_DONE
+	    || !ChanTable_count(self->channels))
+    {
+	Protocol_destroy(self);
+	return;
+    }
+    logclosed(self);
+
+    const char *remote = remotestr(self->remote, self->tcp);
+    if (remote != self->remote) snprintf(self->remote, REMOTESZ, "%s", remote);
+    PSC_Event_unregister(PSC_Connection_dataReceived(self->tcp), self,
+	    received, 0);
+    PSC_Event_unregister(PSC_Connection_dataSent(self->tcp), self, sent, 0);
+    self->tcp = 0;
+    PSC_Timer_stop(self->timer);
+    if (self->holdtimer) PSC_Timer_stop(self->holdtimer);
+    self->ticks = self->config->resume;
+    ChanTable_foreach(self->channels, detachconn, 0);
+    if (self->listed) Tunnels_remove(self->tunnels, self);
+    self->listed = 0;
+    if (self->stats) Stats_remove(self->stats, self);
+
+    PSC_Log_fmt(PSC_L_INFO, "Protocol: keeping %zu socket connections "
+	    "for %d seconds to resume the session",
+	    ChanTable_count(self->channels), self->config->resume);
+}
+
+void Protocol_dropSession(Protocol *self)
+{
+    Sessions_remove(self->sessions, self);
+    self->sessions = 0;
+    self->tokenref = 0;
+    if (!self->tcp) Protocol_destroy(self);
+}
+
+void Protocol_destroy(Protocol *self)
+{
+    if (!self) return;
+
+    if (self->tcp) logclosed(self);
+    unbond(self);
+    if (self->sessions) Sessions_remove(self->sessions, self);
+    if (self->tokenref && !memcmp(self->tokenref, self->token,
+		SESSION_TOKENSZ))
+    {
+	/* the peer forgets the session as well, so there's nothing left to
+	 * resume */
+	memset(self->tokenref, 0, SESSION_TOKENSZ);
+    }
+
+    ChanTable_destroy(self->channels, deleteconn);
+    Pool_destroy(self->connpool, freebufs);
+
+    if (self->listed) Tunnels_remove(self->tunnels, self);
+    if (self->stats) Stats_remove(self->stats, self);
+
+    PSC_Event_unregister(PSC_Service_eventsDone(), self, flush, 0);
+    PSC_Event_unregister(PSC_Service_tick(), self, tick, 0);
+    PSC_Timer_destroy(self->timer);
+    if (self->holdtimer) PSC_Timer_destroy(self->holdtimer);
+
+    Latency_destroy(self->rtt);
+    Latency_destroy(self->connect);
+    Latency_destroy(self->outwait);
+    free(self->outq.data);
+    free(self->out.data);
+    free(self->ctlq.data);
+    free(self->ctlout.data);
+#ifdef WITH_ZSTD
+    free(self->zbuf.data);
+#endif
     free(self);
 }
 
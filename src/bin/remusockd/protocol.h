@@ -1,6 +1,7 @@
 #ifndef REMUSOCKD_PROTOCOL_H
 #define REMUSOCKD_PROTOCOL_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define CMD_IDENT   0x49
@@ -10,10 +11,24 @@
 #define CMD_CONNECT 0x43
 #define CMD_BYE	    0x42
 #define	CMD_DATA    0x44
+#define CMD_WINDOW  0x57
+#define CMD_JOIN    0x4a
+#define CMD_SDATA   0x54
+#define CMD_ZDATA   0x5a
+#define CMD_SESSION 0x53
+#define CMD_RESUME  0x52
 
 #define ARG_SERVER  0x53
 #define ARG_CLIENT  0x43
 
+#define FEAT_WINDOW 0x0001
+#define FEAT_FRAMEV2 0x0002
+#define FEAT_BOND 0x0004
+#define FEAT_COMPRESS 0x0008
+#define FEAT_EARLYDATA 0x0010
+#define FEAT_TIMESTAMP 0x0020
+#define FEAT_RESUME 0x0040
+
 #define IDENTTICKS  2
 
 extern const uint8_t idsrv[];
@@ -21,12 +36,94 @@ extern const uint8_t idcli[];
 
 typedef struct Protocol Protocol;
 
+typedef struct Latency Latency;
+
+typedef struct ChannelStats
+{
+    unsigned long long rxbytes;
+    unsigned long long rxframes;
+    unsigned long long txbytes;
+    unsigned long long txframes;
+    size_t queued;
+    size_t credit;
+    uint32_t id;
+    int paused;
+    int blocked;
+} ChannelStats;
+
+typedef struct ProtocolStats
+{
+    const char *remote;
+    unsigned long long rxbytes;
+    unsigned long long rxframes;
+    unsigned long long txbytes;
+    unsigned long long txframes;
+    unsigned long long writes;
+    unsigned long long reads;
+    unsigned long long merged;
+    unsigned long long dataframes;
+    unsigned long long zin;
+    unsigned long long zout;
+    size_t channels;
+    size_t opened;
+    size_t queued;
+    size_t paused;
+    size_t blocked;
+    const Latency *rtt;
+    const Latency *connect;
+    const Latency *outwait;
+    uint16_t features;
+} ProtocolStats;
+
+typedef struct Bonds Bonds;
+typedef struct Config Config;
 typedef struct PSC_Connection PSC_Connection;
-typedef struct PSC_Server PSC_Server;
+typedef struct Sessions Sessions;
+typedef struct Stats Stats;
+typedef struct Tunnels Tunnels;
 typedef struct PSC_UnixClientOpts PSC_UnixClientOpts;
 
-Protocol *Protocol_create(PSC_Connection *tcp, PSC_Server *sockserver,
-	PSC_UnixClientOpts *sockopts);
+/* sessions may be 0, otherwise an established session is registered there
+ * when resumption is configured, the same goes for bonds and bonding, and
+ * for stats, where the protocol is registered while connected */
+Protocol *Protocol_create(PSC_Connection *tcp, Tunnels *tunnels,
+	PSC_UnixClientOpts *sockopts, Sessions *sessions, Bonds *bonds,
+	Stats *stats, const Config *config, int tcpclient);
+
+/* for the TCP client: ask to resume the session identified by the
+ * SESSION_TOKENSZ bytes at token, they are set to the session actually
+ * used once the server answered, and cleared when it ends */
+void Protocol_session(Protocol *self, uint8_t *token);
+/* for the TCP client: join the bond with the BOND_IDSZ bytes at id as
+ * tunnel number index, once the server agreed to bonding */
+void Protocol_bond(Protocol *self, const uint8_t *id, unsigned index);
+int Protocol_accept(Protocol *self, PSC_Connection *sockconn);
+
+/* handle data read from TCP before the protocol was created */
+void Protocol_receive(Protocol *self, const uint8_t *data, size_t sz);
+
+/* number of socket connections currently tunnelled */
+size_t Protocol_load(const Protocol *self);
+
+/* round-trip times measured on the TCP connection */
+const Latency *Protocol_rtt(const Protocol *self);
+
+/* queued counts data waiting in the channels and not yet written to TCP,
+ * a channel is blocked while it has data queued, but no credit left,
+ * merged counts socket reads appended to data of the same channel that
+ * wasn't framed yet, zin counts data offered to compression and zout the
+ * bytes it was sent as, compressed or not */
+void Protocol_stats(Protocol *self, ProtocolStats *stats);
+void Protocol_channelStats(Protocol *self,
+	void (*report)(void *arg, const ChannelStats *stats), void *arg);
+
+/* called when the TCP connection is gone, keeps the socket connections
+ * for a while if the peer may resume the session, destroys otherwise */
+void Protocol_detach(Protocol *self);
+
+/* removes the session from its registry, so it can't be resumed any more,
+ * destroys it if it is waiting for a new TCP connection */
+void Protocol_dropSession(Protocol *self);
 void Protocol_destroy(Protocol *self);
 
 #endif
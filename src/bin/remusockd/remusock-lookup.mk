@@ -0,0 +1,6 @@
+remusock-lookup_MODULES:=	chantable \
+			lookup
+
+remusock-lookup_PKGDEPS:=	posercore
+
+$(call binrules, remusock-lookup)
@@ -0,0 +1,18 @@
+remusock-replay_MODULES:=	bonds \
+			chantable \
+			latency \
+			pool \
+			protocol \
+			replay \
+			sessions \
+			stats \
+			tunnels
+
+remusock-replay_PKGDEPS:=	posercore
+
+ifeq ($(WITH_ZSTD),1)
+remusock-replay_DEFINES+=	-DWITH_ZSTD
+remusock-replay_PKGDEPS+=	libzstd
+endif
+
+$(call binrules, remusock-replay)
@@ -1,5 +1,7 @@
 #include "config.h"
+#include "protocol.h"
 #include "remusock.h"
+#include "stats.h"
 #include "tcpclient.h"
 #include "tcpserver.h"
 
@@ -31,6 +33,17 @@ int RemUSock_init(const Config *config)
     PSC_UnixClientOpts *sockopts = 0;
     PSC_Server *sockserver = 0;
 
+#ifndef WITH_ZSTD
+    if (config->compress)
+    {
+	PSC_Log_msg(PSC_L_WARNING, "Compression requested, but remusockd "
+		"was built without zstd support");
+    }
+#endif
+
+    Stats *stats = Stats_create(config);
+    if (!stats) return -1;
+
     if (config->hashes)
     {
 	hashes = PSC_HashTable_create(6);
@@ -56,21 +69,39 @@ int RemUSock_init(const Config *config)
 	PSC_UnixServerOpts_mode(opts, config->sockmode);
 	sockserver = PSC_Server_createUnix(opts);
 	PSC_UnixServerOpts_destroy(opts);
-	if (!sockserver) return -1;
+	if (!sockserver)
+	{
+	    Stats_destroy(stats);
+	    return -1;
+	}
 	PSC_Server_disable(sockserver);
     }
 
-    if (config->remotehost)
+    if (config->remotehost[0])
     {
-	PSC_TcpClientOpts *opts = PSC_TcpClientOpts_create(
-		config->remotehost, config->port);
-	if (config->numericHosts) PSC_TcpClientOpts_numericHosts(opts);
-	if (config->tls)
+	PSC_TcpClientOpts *opts[MAXREMOTES];
+	int nopts;
+	for (nopts = 0; nopts < MAXREMOTES && config->remotehost[nopts];
+		++nopts)
 	{
-	    PSC_TcpClientOpts_enableTls(opts, config->cert, config->key);
-	    if (config->noverify) PSC_TcpClientOpts_disableCertVerify(opts);
+	    opts[nopts] = PSC_TcpClientOpts_create(
+		    config->remotehost[nopts], config->port);
+	    if (config->numericHosts)
+	    {
+		PSC_TcpClientOpts_numericHosts(opts[nopts]);
+	    }
+	    if (config->tls)
+	    {
+		PSC_TcpClientOpts_enableTls(opts[nopts],
+			config->cert, config->key);
+		if (config->noverify)
+		{
+		    PSC_TcpClientOpts_disableCertVerify(opts[nopts]);
+		}
+	    }
 	}
-	client = TcpClient_create(opts, sockserver, sockopts);
+	client = TcpClient_create(opts, nopts, sockserver, sockopts, stats,
+		config);
     }
     else
     {
@@ -89,13 +120,14 @@ int RemUSock_init(const Config *config)
 		PSC_TcpServerOpts_validateClientCert(opts, 0, checkhash);
 	    }
 	}
-	server = TcpServer_create(opts, sockserver, sockopts);
+	server = TcpServer_create(opts, sockserver, sockopts, stats, config);
     }
 
     if (!server && !client)
     {
 	PSC_UnixClientOpts_destroy(sockopts);
 	PSC_Server_destroy(sockserver);
+	Stats_destroy(stats);
 	return -1;
     }
 
@@ -1,10 +1,22 @@
-remusockd_MODULES:=	config \
+remusockd_MODULES:=	bonds \
+			chantable \
+			config \
+			latency \
 			main \
+			pool \
 			protocol \
 			remusock \
+			sessions \
+			stats \
 			tcpclient \
-			tcpserver
+			tcpserver \
+			tunnels
 
 remusockd_PKGDEPS:=	posercore
 
+ifeq ($(WITH_ZSTD),1)
+remusockd_DEFINES+=	-DWITH_ZSTD
+remusockd_PKGDEPS+=	libzstd
+endif
+
 $(call binrules, remusockd)
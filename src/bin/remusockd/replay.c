@@ -0,0 +1,594 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include "config.h"
+#include "protocol.h"
+
+#include <errno.h>
+#include <poser/core.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* This drives the protocol of remusockd without any sockets: it defines
+ * the PSC_Connection functions used by protocol.c itself, overriding the
+ * ones from poser, and feeds a frame stream to a single Protocol the way
+ * poser would deliver it from a TCP connection. */
+
+#define DEFFRAMES 1000000
+#define BATCH (64*1024)
+#define READSZ (16*1024)
+#define CHANNELS 16
+#define SMALLDATA 64
+#define BULKDATA (16*1024)
+#define CHURNIDS 4096
+#define PEERFEATURES (FEAT_WINDOW|FEAT_FRAMEV2|FEAT_EARLYDATA|FEAT_TIMESTAMP)
+
+typedef struct Buffer
+{
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+} Buffer;
+
+typedef struct Write
+{
+    PSC_Connection *conn;
+    void *id;
+} Write;
+
+struct PSC_Connection
+{
+    PSC_Event *connected;
+    PSC_Event *closed;
+    PSC_Event *dataReceived;
+    PSC_Event *dataSent;
+    PSC_Connection *nextdead;
+    int pending;
+    int isclosed;
+};
+
+struct PSC_EADataReceived
+{
+    uint8_t *buf;
+    uint16_t size;
+    int handling;
+};
+
+typedef struct Workload
+{
+    const char *name;
+    void (*generate)(Buffer *stream, size_t frames);
+} Workload;
+
+static int counting;
+static unsigned long long allocs;
+static Write *writes;
+static size_t nwrites;
+static size_t writescap;
+static PSC_Connection **connects;
+static size_t nconnects;
+static size_t connectscap;
+static PSC_Connection *dead;
+
+static void usage(const char *prgname);
+static uint64_t nsecs(void);
+static void append(Buffer *buf, const uint8_t *data, size_t sz);
+static uint8_t v2code(uint8_t cmd);
+static size_t fieldsz(uint32_t val);
+static void putframe(Buffer *buf, uint8_t cmd, int hasid, uint32_t id,
+	int hasarg, uint32_t arg);
+static void putdata(Buffer *buf, uint32_t id, size_t sz);
+static void putprefix(Buffer *buf);
+static void openchannels(Buffer *buf);
+static void gensmall(Buffer *stream, size_t frames);
+static void genbulk(Buffer *stream, size_t frames);
+static void genchurn(Buffer *stream, size_t frames);
+static void genping(Buffer *stream, size_t frames);
+static void genmixed(Buffer *stream, size_t frames);
+static PSC_Connection *newconn(void);
+static void freeconn(PSC_Connection *conn);
+static void complete(void);
+static int replay(const Config *config, const uint8_t *stream, size_t len,
+	ProtocolStats *stats, unsigned long long *allocated,
+	uint64_t *elapsed);
+static int run(const Config *config, const char *name,
+	const uint8_t *stream, size_t len);
+static int readfile(const char *path, Buffer *buf);
+
+static const Workload workloads[] = {
+    { "small-data", gensmall },
+    { "bulk-data", genbulk },
+    { "hello-bye", genchurn },
+    { "ping", genping },
+    { "mixed", genmixed }
+};
+
+void *PSC_malloc(size_t size)
+{
+    void *ptr = malloc(size);
+    if (!ptr) abort();
+    if (counting) ++allocs;
+    return ptr;
+}
+
+void *PSC_realloc(void *ptr, size_t size)
+{
+    void *p = realloc(ptr, size);
+    if (!p) abort();
+    if (counting) ++allocs;
+    return p;
+}
+
+PSC_Connection *PSC_Connection_createUnixClient(const PSC_UnixClientOpts *opts)
+{
+    (void)opts;
+
+    PSC_Connection *conn = newconn();
+    if (nconnects == connectscap)
+    {
+	connectscap = connectscap ? 2 * connectscap : 64;
+	connects = realloc(connects, connectscap * sizeof *connects);
+	if (!connects) abort();
+    }
+    connects[nconnects++] = conn;
+    return conn;
+}
+
+PSC_Event *PSC_Connection_connected(PSC_Connection *self)
+{
+    return self->connected;
+}
+
+PSC_Event *PSC_Connection_closed(PSC_Connection *self)
+{
+    return self->closed;
+}
+
+PSC_Event *PSC_Connection_dataReceived(PSC_Connection *self)
+{
+    return self->dataReceived;
+}
+
+PSC_Event *PSC_Connection_dataSent(PSC_Connection *self)
+{
+    return self->dataSent;
+}
+
+const char *PSC_Connection_remoteAddr(const PSC_Connection *self)
+{
+    (void)self;
+    return "replay";
+}
+
+const char *PSC_Connection_remoteHost(const PSC_Connection *self)
+{
+    (void)self;
+    return 0;
+}
+
+int PSC_Connection_sendAsync(PSC_Connection *self,
+	const uint8_t *buf, size_t sz, void *id)
+{
+    (void)buf;
+    (void)sz;
+
+    if (self->isclosed) return -1;
+    if (nwrites == writescap)
+    {
+	writescap = writescap ? 2 * writescap : 64;
+	writes = realloc(writes, writescap * sizeof *writes);
+	if (!writes) abort();
+    }
+    writes[nwrites].conn = self;
+    writes[nwrites++].id = id;
+    ++self->pending;
+    return 0;
+}
+
+void PSC_Connection_close(PSC_Connection *self, int blacklist)
+{
+    (void)blacklist;
+
+    if (self->isclosed) return;
+    self->isclosed = 1;
+    PSC_Event_raise(self->closed, 0, 0);
+    self->nextdead = dead;
+    dead = self;
+}
+
+void PSC_Connection_pause(PSC_Connection *self)
+{
+    (void)self;
+}
+
+int PSC_Connection_resume(PSC_Connection *self)
+{
+    (void)self;
+    return 0;
+}
+
+int PSC_Connection_confirmDataReceived(PSC_Connection *self)
+{
+    (void)self;
+    return 0;
+}
+
+uint8_t *PSC_EADataReceived_buf(const PSC_EADataReceived *self)
+{
+    return self->buf;
+}
+
+uint16_t PSC_EADataReceived_size(const PSC_EADataReceived *self)
+{
+    return self->size;
+}
+
+void PSC_EADataReceived_markHandling(PSC_EADataReceived *self)
+{
+    self->handling = 1;
+}
+
+static void usage(const char *prgname)
+{
+    fprintf(stderr, "Usage: %s [-n frames] [-f file]\n", prgname);
+    fputs("\n\t-f file        replay the frames in `file' instead of the\n"
+	    "\t               synthetic workloads. It must contain what a\n"
+	    "\t               socket server side sends through TCP as the\n"
+	    "\t               TCP client, after the initial 2 bytes.\n"
+	    "\t-n frames      number of frames per synthetic workload,\n"
+	    "\t               defaults to 1000000\n"
+	    "\n"
+	    "One line of JSON per workload is written to stdout, timing\n"
+	    "includes the fake connections standing in for poser.\n\n",
+	    stderr);
+}
+
+static uint64_t nsecs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000U + ts.tv_nsec;
+}
+
+static void append(Buffer *buf, const uint8_t *data, size_t sz)
+{
+    if (buf->len + sz > buf->cap)
+    {
+	while (buf->len + sz > buf->cap) buf->cap = buf->cap ? 2*buf->cap : 64;
+	buf->data = realloc(buf->data, buf->cap);
+	if (!buf->data) abort();
+    }
+    if (data) memcpy(buf->data + buf->len, data, sz);
+    else memset(buf->data + buf->len, 'x', sz);
+    buf->len += sz;
+}
+
+static uint8_t v2code(uint8_t cmd)
+{
+    switch (cmd)
+    {
+	case CMD_PING: return 1;
+	case CMD_PONG: return 2;
+	case CMD_HELLO: return 3;
+	case CMD_CONNECT: return 4;
+	case CMD_BYE: return 5;
+	case CMD_DATA: return 6;
+	case CMD_WINDOW: return 7;
+	default: return 8;
+    }
+}
+
+static size_t fieldsz(uint32_t val)
+{
+    if (val > 0xffffffU) return 4;
+    if (val > 0xffffU) return 3;
+    if (val > 0xffU) return 2;
+    return 1;
+}
+
+static void putframe(Buffer *buf, uint8_t cmd, int hasid, uint32_t id,
+	int hasarg, uint32_t arg)
+{
+    uint8_t frame[9];
+    size_t idsz = hasid ? fieldsz(id) : 0;
+    size_t argsz = hasarg ? fieldsz(arg) : 0;
+    frame[0] = v2code(cmd) << 4 | (idsz ? idsz - 1 : 0) << 2
+	| (argsz ? argsz - 1 : 0);
+    size_t len = 1;
+    while (idsz) frame[len++] = id >> (8 * --idsz) & 0xff;
+    while (argsz) frame[len++] = arg >> (8 * --argsz) & 0xff;
+    append(buf, frame, len);
+}
+
+static void putdata(Buffer *buf, uint32_t id, size_t sz)
+{
+    putframe(buf, CMD_DATA, 1, id, 1, sz);
+    append(buf, 0, sz);
+}
+
+static void putprefix(Buffer *buf)
+{
+    /* announce feature negotiation and answer the offer */
+    uint8_t neg[] = { CMD_PONG, CMD_IDENT,
+	PEERFEATURES >> 8, PEERFEATURES & 0xff };
+    append(buf, neg, sizeof neg);
+}
+
+static void openchannels(Buffer *buf)
+{
+    for (uint32_t id = 0; id < CHANNELS; ++id)
+    {
+	putframe(buf, CMD_HELLO, 1, id, 0, 0);
+    }
+}
+
+static void gensmall(Buffer *stream, size_t frames)
+{
+    putprefix(stream);
+    openchannels(stream);
+    for (size_t i = 0; i < frames; ++i)
+    {
+	putdata(stream, i % CHANNELS, SMALLDATA);
+    }
+}
+
+static void genbulk(Buffer *stream, size_t frames)
+{
+    putprefix(stream);
+    openchannels(stream);
+    for (size_t i = 0; i < frames; ++i)
+    {
+	putdata(stream, i % CHANNELS, BULKDATA);
+    }
+}
+
+static void genchurn(Buffer *stream, size_t frames)
+{
+    putprefix(stream);
+    for (size_t i = 0; i < frames / 2; ++i)
+    {
+	putframe(stream, CMD_HELLO, 1, i % CHURNIDS, 0, 0);
+	putframe(stream, CMD_BYE, 1, i % CHURNIDS, 0, 0);
+    }
+}
+
+static void genping(Buffer *stream, size_t frames)
+{
+    putprefix(stream);
+    for (size_t i = 0; i < frames; ++i)
+    {
+	putframe(stream, CMD_PING, 0, 0, 1, (uint32_t)(i * 977));
+    }
+}
+
+static void genmixed(Buffer *stream, size_t frames)
+{
+    /* mostly small data, some channel churn, an occasional ping */
+    putprefix(stream);
+    openchannels(stream);
+    size_t n = 0;
+    uint32_t churn = CHANNELS;
+    while (n < frames)
+    {
+	for (int i = 0; i < 8 && n < frames; ++i, ++n)
+	{
+	    putdata(stream, n % CHANNELS, SMALLDATA);
+	}
+	if (n + 2 <= frames)
+	{
+	    putframe(stream, CMD_HELLO, 1, churn, 0, 0);
+	    putframe(stream, CMD_BYE, 1, churn, 0, 0);
+	    if (++churn == CHURNIDS) churn = CHANNELS;
+	    n += 2;
+	}
+	if (n < frames && !(n % 1000))
+	{
+	    putframe(stream, CMD_PING, 0, 0, 1, (uint32_t)n);
+	    ++n;
+	}
+    }
+}
+
+static PSC_Connection *newconn(void)
+{
+    int wascounting = counting;
+    counting = 0;
+    PSC_Connection *conn = calloc(1, sizeof *conn);
+    if (!conn) abort();
+    conn->connected = PSC_Event_create(conn);
+    conn->closed = PSC_Event_create(conn);
+    conn->dataReceived = PSC_Event_create(conn);
+    conn->dataSent = PSC_Event_create(conn);
+    conn->pending = 1;
+    counting = wascounting;
+    return conn;
+}
+
+static void freeconn(PSC_Connection *conn)
+{
+    PSC_Event_destroy(conn->connected);
+    PSC_Event_destroy(conn->closed);
+    PSC_Event_destroy(conn->dataReceived);
+    PSC_Event_destroy(conn->dataSent);
+    free(conn);
+}
+
+static void complete(void)
+{
+    /* what poser would do between two batches of received data: connect
+     * new socket connections and finish all writes */
+    for (size_t i = 0; i < nconnects; ++i)
+    {
+	PSC_Connection *conn = connects[i];
+	--conn->pending;
+	if (!conn->isclosed) PSC_Event_raise(conn->connected, 0, 0);
+    }
+    nconnects = 0;
+    for (size_t i = 0; i < nwrites; ++i)
+    {
+	Write w = writes[i];
+	--w.conn->pending;
+	if (!w.conn->isclosed) PSC_Event_raise(w.conn->dataSent, 0, w.id);
+    }
+    nwrites = 0;
+
+    PSC_Connection **prev = &dead;
+    PSC_Connection *conn;
+    while ((conn = *prev))
+    {
+	if (conn->pending)
+	{
+	    prev = &conn->nextdead;
+	    continue;
+	}
+	*prev = conn->nextdead;
+	freeconn(conn);
+    }
+}
+
+static int replay(const Config *config, const uint8_t *stream, size_t len,
+	ProtocolStats *stats, unsigned long long *allocated,
+	uint64_t *elapsed)
+{
+    PSC_UnixClientOpts *sockopts = PSC_UnixClientOpts_create("replay");
+    PSC_Connection *tcp = newconn();
+    tcp->pending = 0;
+    allocs = 0;
+    counting = 1;
+    uint64_t start = nsecs();
+
+    Protocol *proto = Protocol_create(tcp, 0, sockopts, 0, 0, 0, config, 0);
+    size_t pos = 0;
+    while (pos < len && !tcp->isclosed)
+    {
+	size_t batchend = pos + BATCH;
+	while (pos < len && pos < batchend && !tcp->isclosed)
+	{
+	    size_t sz = len - pos < READSZ ? len - pos : READSZ;
+	    PSC_EADataReceived ea = { (uint8_t *)stream + pos, sz, 0 };
+	    pos += sz;
+	    PSC_Event_raise(tcp->dataReceived, 0, &ea);
+	}
+	PSC_Event_raise(PSC_Service_eventsDone(), 0, 0);
+	complete();
+    }
+
+    *elapsed = nsecs() - start;
+    *allocated = allocs;
+    counting = 0;
+    int ok = !tcp->isclosed;
+    Protocol_stats(proto, stats);
+    Protocol_destroy(proto);
+    PSC_Connection_close(tcp, 0);
+    complete();
+    PSC_UnixClientOpts_destroy(sockopts);
+    return ok ? 0 : -1;
+}
+
+static int run(const Config *config, const char *name,
+	const uint8_t *stream, size_t len)
+{
+    ProtocolStats stats;
+    unsigned long long allocated;
+    uint64_t elapsed;
+    if (replay(config, stream, len, &stats, &allocated, &elapsed) < 0)
+    {
+	fprintf(stderr, "%s: stream rejected or truncated\n", name);
+	return -1;
+    }
+    unsigned long long frames = stats.rxframes;
+    printf("{\"workload\":\"%s\",\"frames\":%llu,\"bytes\":%zu,"
+	    "\"ns_per_frame\":%.1f,\"allocs_per_frame\":%.4f,"
+	    "\"mb_per_s\":%.1f}\n", name, frames, len,
+	    frames ? (double)elapsed / frames : 0.0,
+	    frames ? (double)allocated / frames : 0.0,
+	    elapsed ? len * 1e3 / elapsed : 0.0);
+    fflush(stdout);
+    return 0;
+}
+
+static int readfile(const char *path, Buffer *buf)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) return -1;
+    uint8_t chunk[BATCH];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof chunk, f)) > 0) append(buf, chunk, n);
+    int rc = ferror(f) ? -1 : 0;
+    fclose(f);
+    return rc;
+}
+
+int main(int argc, char **argv)
+{
+    const char *prgname = argc > 0 ? argv[0] : "remusock-replay";
+    const char *file = 0;
+    long frames = DEFFRAMES;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:n:")) != -1)
+    {
+	char *endp;
+	switch (opt)
+	{
+	    case 'f':
+		file = optarg;
+		break;
+	    case 'n':
+		errno = 0;
+		frames = strtol(optarg, &endp, 10);
+		if (errno == ERANGE || *endp || frames < 1)
+		{
+		    usage(prgname);
+		    return EXIT_FAILURE;
+		}
+		break;
+	    default:
+		usage(prgname);
+		return EXIT_FAILURE;
+	}
+    }
+    if (optind != argc)
+    {
+	usage(prgname);
+	return EXIT_FAILURE;
+    }
+
+    Config config;
+    memset(&config, 0, sizeof config);
+    config.sendqueue = 262144;
+    config.tunnels = 1;
+
+    int rc = EXIT_SUCCESS;
+    Buffer stream = { 0, 0, 0 };
+    if (file)
+    {
+	if (readfile(file, &stream) < 0)
+	{
+	    perror(file);
+	    return EXIT_FAILURE;
+	}
+	if (run(&config, file, stream.data, stream.len) < 0)
+	{
+	    rc = EXIT_FAILURE;
+	}
+    }
+    else for (size_t i = 0; i < sizeof workloads / sizeof *workloads; ++i)
+    {
+	stream.len = 0;
+	workloads[i].generate(&stream, frames);
+	if (run(&config, workloads[i].name, stream.data, stream.len) < 0)
+	{
+	    rc = EXIT_FAILURE;
+	}
+    }
+
+    free(stream.data);
+    free(writes);
+    free(connects);
+    return rc;
+}
@@ -0,0 +1,108 @@
+#include "latency.h"
+#include "protocol.h"
+#include "sessions.h"
+
+#include <poser/core.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct Session
+{
+    Protocol *proto;
+    uint8_t token[SESSION_TOKENSZ];
+} Session;
+
+struct Sessions
+{
+    Session *sessions;
+    size_t size;
+    size_t count;
+};
+
+static const uint8_t notoken[SESSION_TOKENSZ];
+
+Sessions *Sessions_create(void)
+{
+    Sessions *self = PSC_malloc(sizeof *self);
+    self->sessions = 0;
+    self->size = 0;
+    self->count = 0;
+    return self;
+}
+
+void Sessions_add(Sessions *self, Protocol *proto, const uint8_t *token)
+{
+    if (self->count == self->size)
+    {
+	self->size = self->size ? 2 * self->size : 4;
+	self->sessions = PSC_realloc(self->sessions,
+		self->size * sizeof *self->sessions);
+    }
+    Session *sess = self->sessions + self->count++;
+    sess->proto = proto;
+    memcpy(sess->token, token, SESSION_TOKENSZ);
+}
+
+Protocol *Sessions_find(const Sessions *self, const uint8_t *token)
+{
+    if (!memcmp(token, notoken, SESSION_TOKENSZ)) return 0;
+    for (size_t i = 0; i < self->count; ++i)
+    {
+	if (!memcmp(self->sessions[i].token, token, SESSION_TOKENSZ))
+	{
+	    return self->sessions[i].proto;
+	}
+    }
+    return 0;
+}
+
+void Sessions_remove(Sessions *self, Protocol *proto)
+{
+    for (size_t i = 0; i < self->count; ++i)
+    {
+	if (self->sessions[i].proto == proto)
+	{
+	    self->sessions[i] = self->sessions[--self->count];
+	    return;
+	}
+    }
+}
+
+void Sessions_newToken(const Sessions *self, uint8_t *token)
+{
+    int ok = 0;
+    FILE *urandom = fopen("/dev/urandom", "rb");
+    if (urandom)
+    {
+	ok = fread(token, SESSION_TOKENSZ, 1, urandom) == 1;
+	fclose(urandom);
+    }
+    if (!ok)
+    {
+	PSC_Log_msg(PSC_L_WARNING,
+		"Sessions: can't read /dev/urandom, session token is guessable");
+	uint64_t seed = Latency_now();
+	for (size_t i = 0; i < SESSION_TOKENSZ; ++i)
+	{
+	    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+	    token[i] = seed >> 56;
+	}
+    }
+    while (!memcmp(token, notoken, SESSION_TOKENSZ)
+	    || Sessions_find(self, token))
+    {
+	++token[SESSION_TOKENSZ - 1];
+    }
+}
+
+void Sessions_destroy(Sessions *self)
+{
+    if (!self) return;
+    while (self->count)
+    {
+	Protocol_dropSession(self->sessions[self->count - 1].proto);
+    }
+    free(self->sessions);
+    free(self);
+}
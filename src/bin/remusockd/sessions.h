@@ -0,0 +1,25 @@
+#ifndef REMUSOCKD_SESSIONS_H
+#define REMUSOCKD_SESSIONS_H
+
+#include <stdint.h>
+
+#define SESSION_TOKENSZ 16
+
+typedef struct Sessions Sessions;
+
+typedef struct Protocol Protocol;
+
+/* The sessions a peer may resume, owned by a TcpServer or TcpClient. A
+ * protocol registers itself once its session is established and removes
+ * itself when destroyed. Destroying this ends all sessions, the ones
+ * waiting for a new TCP connection are destroyed. */
+Sessions *Sessions_create(void);
+void Sessions_add(Sessions *self, Protocol *proto, const uint8_t *token);
+Protocol *Sessions_find(const Sessions *self, const uint8_t *token);
+void Sessions_remove(Sessions *self, Protocol *proto);
+
+/* a random token not used by any session, all zero bytes mean no session */
+void Sessions_newToken(const Sessions *self, uint8_t *token);
+void Sessions_destroy(Sessions *self);
+
+#endif
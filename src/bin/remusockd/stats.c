@@ -0,0 +1,210 @@
+#include "config.h"
+#include "latency.h"
+#include "protocol.h"
+#include "stats.h"
+
+#include <poser/core.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define REPORTCHUNK 1024
+
+typedef struct Report
+{
+    char *text;
+    size_t len;
+    size_t cap;
+} Report;
+
+struct Stats
+{
+    PSC_Server *ctlserver;
+    Protocol **protos;
+    size_t size;
+    size_t count;
+    unsigned long long reconnects;
+    unsigned long long resets;
+    unsigned long long resumed;
+};
+
+static void printreport(Report *report, const char *fmt, ...);
+static void reportlatency(Report *report, const char *name,
+	const Latency *latency);
+static void reportchannel(void *arg, const ChannelStats *stats);
+static void reportsent(void *receiver, void *sender, void *args);
+static void newclient(void *receiver, void *sender, void *args);
+
+static void printreport(Report *report, const char *fmt, ...)
+{
+    for (;;)
+    {
+	va_list ap;
+	va_start(ap, fmt);
+	int len = vsnprintf(report->text + report->len,
+		report->cap - report->len, fmt, ap);
+	va_end(ap);
+	if (len < 0) return;
+	if (report->len + len < report->cap)
+	{
+	    report->len += len;
+	    return;
+	}
+	while (report->len + len >= report->cap) report->cap *= 2;
+	report->text = PSC_realloc(report->text, report->cap);
+    }
+}
+
+static void reportlatency(Report *report, const char *name,
+	const Latency *latency)
+{
+    unsigned long long samples = Latency_count(latency);
+    if (!samples) return;
+    printreport(report, "  %s: p50 %lluus, p99 %lluus, p999 %lluus "
+	    "(%llu samples)\n", name,
+	    (unsigned long long)Latency_percentile(latency, 50.0),
+	    (unsigned long long)Latency_percentile(latency, 99.0),
+	    (unsigned long long)Latency_percentile(latency, 99.9), samples);
+}
+
+static void reportchannel(void *arg, const ChannelStats *stats)
+{
+    Report *report = arg;
+    printreport(report, "  channel %u: rx %llu bytes in %llu frames, "
+	    "tx %llu bytes in %llu frames, %zu bytes queued, credit %zu%s%s\n",
+	    (unsigned)stats->id, stats->rxbytes, stats->rxframes,
+	    stats->txbytes, stats->txframes, stats->queued, stats->credit,
+	    stats->paused ? ", paused" : "",
+	    stats->blocked ? ", blocked" : "");
+}
+
+static void reportsent(void *receiver, void *sender, void *args)
+{
+    (void)receiver;
+    (void)args;
+
+    PSC_Connection_close(sender, 0);
+}
+
+static void newclient(void *receiver, void *sender, void *args)
+{
+    (void)sender;
+
+    Stats *self = receiver;
+    PSC_Connection *client = args;
+    Report report = { PSC_malloc(REPORTCHUNK), 0, REPORTCHUNK };
+
+    printreport(&report, "tunnels: %zu, reconnects: %llu, resets: %llu, "
+	    "resumed: %llu\n", self->count, self->reconnects, self->resets,
+	    self->resumed);
+    for (size_t i = 0; i < self->count; ++i)
+    {
+	ProtocolStats ps;
+	Protocol_stats(self->protos[i], &ps);
+	printreport(&report, "tunnel %zu: %s, features 0x%04x\n"
+		"  rx %llu bytes in %llu frames\n"
+		"  tx %llu bytes in %llu frames, %llu writes\n"
+		"  %llu socket reads in %llu data frames, %llu merged\n"
+		"  %zu channels open, %zu opened, %zu paused, %zu blocked, "
+		"%zu bytes queued\n", i, ps.remote, (unsigned)ps.features,
+		ps.rxbytes, ps.rxframes, ps.txbytes, ps.txframes, ps.writes,
+		ps.reads, ps.dataframes, ps.merged,
+		ps.channels, ps.opened, ps.paused, ps.blocked, ps.queued);
+	if (ps.zin)
+	{
+	    printreport(&report, "  compressed %llu bytes to %llu (%.1f%%)\n",
+		    ps.zin, ps.zout, 100.0 * ps.zout / ps.zin);
+	}
+	reportlatency(&report, "round-trip time", ps.rtt);
+	reportlatency(&report, "channel open time", ps.connect);
+	reportlatency(&report, "outbound queue wait", ps.outwait);
+	Protocol_channelStats(self->protos[i], reportchannel, &report);
+    }
+
+    PSC_Connection_setData(client, report.text, free);
+    PSC_Event_register(PSC_Connection_dataSent(client), 0, reportsent, 0);
+    if (PSC_Connection_sendAsync(client, (const uint8_t *)report.text,
+		report.len, client) < 0)
+    {
+	PSC_Connection_close(client, 0);
+    }
+}
+
+Stats *Stats_create(const Config *config)
+{
+    PSC_Server *ctlserver = 0;
+    if (config->ctlsock)
+    {
+	PSC_UnixServerOpts *opts = PSC_UnixServerOpts_create(config->ctlsock);
+	PSC_UnixServerOpts_owner(opts, config->sockuid, config->sockgid);
+	ctlserver = PSC_Server_createUnix(opts);
+	PSC_UnixServerOpts_destroy(opts);
+	if (!ctlserver) return 0;
+    }
+
+    Stats *self = PSC_malloc(sizeof *self);
+    self->ctlserver = ctlserver;
+    self->protos = 0;
+    self->size = 0;
+    self->count = 0;
+    self->reconnects = 0;
+    self->resets = 0;
+    self->resumed = 0;
+    if (ctlserver)
+    {
+	PSC_Event_register(PSC_Server_clientConnected(ctlserver), self,
+		newclient, 0);
+    }
+    return self;
+}
+
+void Stats_add(Stats *self, Protocol *proto)
+{
+    if (self->count == self->size)
+    {
+	self->size = self->size ? 2 * self->size : 4;
+	self->protos = PSC_realloc(self->protos,
+		self->size * sizeof *self->protos);
+    }
+    self->protos[self->count++] = proto;
+}
+
+void Stats_remove(Stats *self, Protocol *proto)
+{
+    for (size_t i = 0; i < self->count; ++i)
+    {
+	if (self->protos[i] == proto)
+	{
+	    self->protos[i] = self->protos[--self->count];
+	    return;
+	}
+    }
+}
+
+void Stats_countReconnect(Stats *self)
+{
+    ++self->reconnects;
+}
+
+void Stats_countReset(Stats *self)
+{
+    ++self->resets;
+}
+
+void Stats_countResume(Stats *self)
+{
+    ++self->resumed;
+}
+
+void Stats_destroy(Stats *self)
+{
+    if (!self) return;
+    if (self->ctlserver)
+    {
+	PSC_Event_unregister(PSC_Server_clientConnected(self->ctlserver),
+		self, newclient, 0);
+	PSC_Server_destroy(self->ctlserver);
+    }
+    free(self->protos);
+    free(self);
+}
@@ -0,0 +1,22 @@
+#ifndef REMUSOCKD_STATS_H
+#define REMUSOCKD_STATS_H
+
+typedef struct Stats Stats;
+
+typedef struct Config Config;
+typedef struct Protocol Protocol;
+
+/* The tunnels of a TcpServer or TcpClient, owned by it. Reports their
+ * statistics as plain text to every client connecting to the control
+ * socket. Without a control socket configured, nothing is reported, but
+ * registering is still allowed. Returns 0 when the control socket can't
+ * be created. */
+Stats *Stats_create(const Config *config);
+void Stats_add(Stats *self, Protocol *proto);
+void Stats_remove(Stats *self, Protocol *proto);
+void Stats_countReconnect(Stats *self);
+void Stats_countReset(Stats *self);
+void Stats_countResume(Stats *self);
+void Stats_destroy(Stats *self);
+
+#endif
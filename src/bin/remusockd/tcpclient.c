@@ -1,21 +1,66 @@
+#include "bonds.h"
+#include "config.h"
+#include "latency.h"
 #include "protocol.h"
+#include "sessions.h"
+#include "stats.h"
 #include "tcpclient.h"
+#include "tunnels.h"
 
 #include <poser/core.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
+#define RECONNMSLOST 1000
+#define RECONNTICKSLOST 1
 #define RECONNTICKSNORM	6
 #define RECONNTICKSERR 30
 
-struct TcpClient
+typedef struct Endpoint
+{
+    PSC_TcpClientOpts *opts;
+    const char *host;
+    uint64_t rtt;
+    int links;
+    int downticks;
+    int reached;
+} Endpoint;
+
+typedef struct Link
 {
+    TcpClient *client;
+    Endpoint *endpoint;
     PSC_Connection *tcpclient;
-    PSC_TcpClientOpts *clientopts;
-    PSC_Server *sockserver;
-    PSC_UnixClientOpts *sockopts;
+    Protocol *proto;
+    PSC_Timer *reconn;
     int ticks;
+    uint8_t token[SESSION_TOKENSZ];
+    size_t identlen;
+    uint8_t ident[2];
+} Link;
+
+struct TcpClient
+{
+    Endpoint *endpoints;
+    Tunnels *tunnels;
+    Sessions *sessions;
+    Bonds *bonds;
+    Stats *stats;
+    PSC_UnixClientOpts *sockopts;
+    const Config *config;
+    Link *links;
+    int nendpoints;
+    int nlinks;
+    uint8_t bondid[BOND_IDSZ];
 };
 
+static int jitter(int delay);
+static void reconnect(Link *self, unsigned ms);
+static Endpoint *pickendpoint(TcpClient *self);
+static void failed(Link *self, int ticks);
+static void checkhealth(void *receiver, void *sender, void *args);
 static void deleteproto(void *proto);
 static void identsent(void *receiver, void *sender, void *args);
 static void identcheck(void *receiver, void *sender, void *args);
@@ -24,45 +69,136 @@ static void checkreconn(void *receiver, void *sender, void *args);
 static void connlost(void *receiver, void *sender, void *args);
 static void connected(void *receiver, void *sender, void *args);
 static void connectioncreated(void *receiver, PSC_Connection *client);
-static void connect(TcpClient *self);
+static void connect(Link *self);
+
+static int jitter(int delay)
+{
+    /* randomize between 1/2 and 3/2 of the delay, so many clients losing
+     * their connections at once don't all do their TLS handshakes in the
+     * same second when reconnecting */
+    return delay - delay / 2 + rand() % (delay + 1);
+}
+
+static void reconnect(Link *self, unsigned ms)
+{
+    PSC_Timer_setMs(self->reconn, ms);
+    PSC_Timer_start(self->reconn, 0);
+}
+
+static Endpoint *pickendpoint(TcpClient *self)
+{
+    for (int i = 0; i < self->nlinks; ++i)
+    {
+	Link *link = self->links + i;
+	if (link->proto && Latency_count(Protocol_rtt(link->proto)))
+	{
+	    link->endpoint->rtt = Latency_percentile(
+		    Protocol_rtt(link->proto), 50.0);
+	}
+    }
+
+    /* hosts that are up first, then the one with the fewest tunnels, then
+     * the fastest one, a host never measured counts as fastest */
+    Endpoint *best = 0;
+    for (int i = 0; i < self->nendpoints; ++i)
+    {
+	Endpoint *ep = self->endpoints + i;
+	if (!best
+		|| (best->downticks && ep->downticks < best->downticks)
+		|| (!ep->downticks && !best->downticks
+		    && (ep->links < best->links
+			|| (ep->links == best->links && ep->rtt < best->rtt))))
+	{
+	    best = ep;
+	}
+    }
+    return best;
+}
+
+static void failed(Link *self, int ticks)
+{
+    Endpoint *ep = self->endpoint;
+    --ep->links;
+    self->endpoint = 0;
+    if (ticks > ep->downticks) ep->downticks = ticks;
+
+    Endpoint *next = pickendpoint(self->client);
+    if (next->downticks) reconnect(self, next->downticks * 1000U);
+    else
+    {
+	PSC_Log_fmt(PSC_L_INFO, "TcpClient: failing over to %s", next->host);
+	connect(self);
+    }
+    Stats_countReconnect(self->client->stats);
+}
+
+static void checkhealth(void *receiver, void *sender, void *args)
+{
+    (void)sender;
+    (void)args;
+
+    TcpClient *self = receiver;
+    for (int i = 0; i < self->nendpoints; ++i)
+    {
+	if (self->endpoints[i].downticks) --self->endpoints[i].downticks;
+    }
+}
 
 static void deleteproto(void *proto)
 {
-    Protocol_destroy(proto);
+    Protocol_detach(proto);
 }
 
 static void identsent(void *receiver, void *sender, void *args)
 {
     (void)args;
 
-    TcpClient *self = receiver;
+    Link *self = receiver;
     PSC_Connection *client = sender;
 
     PSC_Event_unregister(PSC_Connection_dataSent(client), self, identsent, 0);
     PSC_Connection_confirmDataReceived(client);
 
-    Protocol *proto = Protocol_create(client,
-	    self->sockserver, self->sockopts);
+    Protocol *proto = Protocol_create(client, self->client->tunnels,
+	    self->client->sockopts, self->client->sessions,
+	    self->client->bonds, self->client->stats, self->client->config, 1);
+    Protocol_session(proto, self->token);
+    if (self->client->config->bond)
+    {
+	Protocol_bond(proto, self->client->bondid,
+		(unsigned)(self - self->client->links));
+    }
     PSC_Connection_setData(client, proto, deleteproto);
+    self->proto = proto;
+    self->endpoint->reached = 1;
 }
 
 static void identcheck(void *receiver, void *sender, void *args)
 {
-    TcpClient *self = receiver;
+    Link *self = receiver;
     PSC_Connection *client = sender;
     PSC_EADataReceived *dra = args;
 
+    const uint8_t *buf = PSC_EADataReceived_buf(dra);
+    size_t sz = PSC_EADataReceived_size(dra);
+    while (sz && self->identlen < sizeof self->ident)
+    {
+	self->ident[self->identlen++] = *buf++;
+	--sz;
+    }
+    if (self->identlen < sizeof self->ident) return;
+
     PSC_Event_unregister(PSC_Service_tick(), self, identtimeout, 0);
     PSC_Event_unregister(PSC_Connection_dataReceived(client), self,
 	    identcheck, 0);
 
-    const uint8_t *buf = PSC_EADataReceived_buf(dra);
-    if (buf[0] != CMD_IDENT) goto protoerr;
+    /* the server waits for our identification before sending more */
+    if (sz || self->ident[0] != CMD_IDENT) goto protoerr;
 
-    switch (buf[1])
+    switch (self->ident[1])
     {
 	case ARG_SERVER:
-	    if (self->sockserver)
+	    if (self->client->tunnels)
 	    {
 		PSC_Log_msg(PSC_L_WARNING, "TcpClient: server identified as "
 			"socket server, expected socket client");
@@ -71,7 +207,7 @@ static void identcheck(void *receiver, void *sender, void *args)
 	    break;
 
 	case ARG_CLIENT:
-	    if (!self->sockserver)
+	    if (!self->client->tunnels)
 	    {
 		PSC_Log_msg(PSC_L_WARNING, "TcpClient: server identified as "
 			"socked client, expected socket server");
@@ -86,7 +222,7 @@ static void identcheck(void *receiver, void *sender, void *args)
     PSC_EADataReceived_markHandling(dra);
     PSC_Event_register(PSC_Connection_dataSent(client), self, identsent, 0);
     PSC_Connection_sendAsync(client,
-	    self->sockserver ? idsrv : idcli, 2, self);
+	    self->client->tunnels ? idsrv : idcli, 2, self);
     return;
 
 protoerr:
@@ -101,7 +237,7 @@ static void identtimeout(void *receiver, void *sender, void *args)
     (void)sender;
     (void)args;
 
-    TcpClient *self = receiver;
+    Link *self = receiver;
 
     if (!--self->ticks)
     {
@@ -115,44 +251,58 @@ static void checkreconn(void *receiver, void *sender, void *args)
     (void)sender;
     (void)args;
 
-    TcpClient *self = receiver;
-    if (!--self->ticks)
-    {
-	PSC_Event_unregister(PSC_Service_tick(), self, checkreconn, 0);
-	connect(self);
-    }
+    connect(receiver);
 }
 
 static void connlost(void *receiver, void *sender, void *args)
 {
     (void)sender;
 
-    TcpClient *self = receiver;
+    Link *self = receiver;
+    Endpoint *ep = self->endpoint;
+    Protocol *proto = self->proto;
+    Protocol *sess = Sessions_find(self->client->sessions, self->token);
 
     self->tcpclient = 0;
+    self->proto = 0;
 
     if (args)
     {
-	PSC_Log_msg(PSC_L_INFO,
-		"TcpClient: connection lost, scheduling reconnection");
-	self->ticks = RECONNTICKSNORM;
+	PSC_Log_fmt(PSC_L_INFO, "TcpClient: connection to %s lost, "
+		"scheduling reconnection", ep->host);
 	PSC_Event_unregister(PSC_Service_tick(), self, identtimeout, 0);
+	if (!proto)
+	{
+	    /* the host accepted the connection, but didn't identify */
+	    failed(self, jitter(RECONNTICKSNORM));
+	}
+	else if (sess && Protocol_load(sess))
+	{
+	    /* the session can only be resumed with the same host */
+	    reconnect(self, jitter(RECONNMSLOST));
+	    Stats_countReconnect(self->client->stats);
+	}
+	else
+	{
+	    /* the host is probably still there, it's just this connection,
+	     * but prefer other hosts for a moment */
+	    failed(self, jitter(RECONNTICKSLOST));
+	}
     }
     else
     {
-	PSC_Log_msg(PSC_L_INFO,
-		"TcpClient: failed to connect, scheduling reconnection");
-	self->ticks = RECONNTICKSERR;
+	PSC_Log_fmt(PSC_L_INFO, "TcpClient: failed to connect to %s, "
+		"scheduling reconnection", ep->host);
+	failed(self, jitter(ep->reached ?
+		RECONNTICKSNORM : RECONNTICKSERR));
     }
-
-    PSC_Event_register(PSC_Service_tick(), self, checkreconn, 0);
 }
 
 static void connected(void *receiver, void *sender, void *args)
 {
     (void)args;
 
-    TcpClient *self = receiver;
+    Link *self = receiver;
     PSC_Connection *client = sender;
 
     PSC_Event_unregister(PSC_Connection_connected(client), self, connected, 0);
@@ -162,19 +312,19 @@ static void connected(void *receiver, void *sender, void *args)
     PSC_Event_register(PSC_Service_tick(), self, identtimeout, 0);
 
     self->ticks = IDENTTICKS;
-    PSC_Connection_receiveBinary(client, 2);
+    self->identlen = 0;
 }
 
 static void connectioncreated(void *receiver, PSC_Connection *client)
 {
-    TcpClient *self = receiver;
+    Link *self = receiver;
 
     if (!client)
     {
-	PSC_Log_msg(PSC_L_INFO,
-		"TcpClient: failed to connect, scheduling reconnection");
-	self->ticks = RECONNTICKSERR;
-	PSC_Event_register(PSC_Service_tick(), self, checkreconn, 0);
+	PSC_Log_fmt(PSC_L_INFO, "TcpClient: failed to connect to %s, "
+		"scheduling reconnection", self->endpoint->host);
+	failed(self, jitter(self->endpoint->reached ?
+		RECONNTICKSNORM : RECONNTICKSERR));
 	return;
     }
 
@@ -183,40 +333,91 @@ static void connectioncreated(void *receiver, PSC_Connection *client)
     PSC_Event_register(PSC_Connection_closed(client), self, connlost, 0);
 }
 
-static void connect(TcpClient *self)
+static void connect(Link *self)
 {
-    if (PSC_Connection_createTcpClientAsync(self->clientopts, self,
+    if (!self->endpoint)
+    {
+	self->endpoint = pickendpoint(self->client);
+	++self->endpoint->links;
+    }
+    if (PSC_Connection_createTcpClientAsync(self->endpoint->opts, self,
 		connectioncreated) < 0)
     {
 	PSC_Service_panic("TcpClient: failed to request client creation.");
     }
 }
 
-TcpClient *TcpClient_create(PSC_TcpClientOpts *opts, PSC_Server *sockserver,
-	PSC_UnixClientOpts *sockopts)
+TcpClient *TcpClient_create(PSC_TcpClientOpts **opts, int nopts,
+	PSC_Server *sockserver, PSC_UnixClientOpts *sockopts, Stats *stats,
+	const Config *config)
 {
     TcpClient *self = PSC_malloc(sizeof *self);
-    self->tcpclient = 0;
-    self->clientopts = opts;
-    self->sockserver = sockserver;
+    srand((unsigned)time(0) ^ (unsigned)(uintptr_t)self);
+    self->nendpoints = nopts;
+    self->endpoints = PSC_malloc(nopts * sizeof *self->endpoints);
+    for (int i = 0; i < nopts; ++i)
+    {
+	self->endpoints[i].opts = opts[i];
+	self->endpoints[i].host = config->remotehost[i];
+	self->endpoints[i].rtt = 0;
+	self->endpoints[i].links = 0;
+	self->endpoints[i].downticks = 0;
+	self->endpoints[i].reached = 0;
+    }
+    self->tunnels = sockserver ? Tunnels_create(sockserver) : 0;
+    self->sessions = Sessions_create();
+    self->bonds = Bonds_create();
+    /* all tunnels form one bond */
+    if (config->bond) Bonds_newId(self->bondid);
+    self->stats = stats;
     self->sockopts = sockopts;
-    self->ticks = 0;
-    connect(self);
+    self->config = config;
+    self->nlinks = config->tunnels;
+    self->links = PSC_malloc(self->nlinks * sizeof *self->links);
+    for (int i = 0; i < self->nlinks; ++i)
+    {
+	self->links[i].client = self;
+	self->links[i].endpoint = 0;
+	self->links[i].tcpclient = 0;
+	self->links[i].proto = 0;
+	self->links[i].reconn = PSC_Timer_create();
+	PSC_Event_register(PSC_Timer_expired(self->links[i].reconn),
+		self->links + i, checkreconn, 0);
+	self->links[i].ticks = 0;
+	memset(self->links[i].token, 0, sizeof self->links[i].token);
+	self->links[i].identlen = 0;
+    }
+    for (int i = 0; i < self->nlinks; ++i) connect(self->links + i);
+    PSC_Event_register(PSC_Service_tick(), self, checkhealth, 0);
     return self;
 }
 
 void TcpClient_destroy(TcpClient *self)
 {
     if (!self) return;
-    if (self->tcpclient)
+    PSC_Event_unregister(PSC_Service_tick(), self, checkhealth, 0);
+    for (int i = 0; i < self->nlinks; ++i)
     {
-	PSC_Event_unregister(PSC_Connection_closed(self->tcpclient),
-		self, connlost, 0);
-	PSC_Connection_close(self->tcpclient, 0);
+	Link *link = self->links + i;
+	if (link->tcpclient)
+	{
+	    PSC_Event_unregister(PSC_Connection_closed(link->tcpclient),
+		    link, connlost, 0);
+	    PSC_Event_unregister(PSC_Service_tick(), link, identtimeout, 0);
+	    PSC_Connection_close(link->tcpclient, 0);
+	}
+	PSC_Timer_destroy(link->reconn);
     }
-    PSC_Server_destroy(self->sockserver);
+    Sessions_destroy(self->sessions);
+    Bonds_destroy(self->bonds);
+    Tunnels_destroy(self->tunnels);
+    Stats_destroy(self->stats);
     PSC_UnixClientOpts_destroy(self->sockopts);
-    PSC_TcpClientOpts_destroy(self->clientopts);
+    for (int i = 0; i < self->nendpoints; ++i)
+    {
+	PSC_TcpClientOpts_destroy(self->endpoints[i].opts);
+    }
+    free(self->endpoints);
+    free(self->links);
     free(self);
 }
-
@@ -3,12 +3,19 @@
 
 typedef struct TcpClient TcpClient;
 
+typedef struct Config Config;
 typedef struct PSC_Server PSC_Server;
 typedef struct PSC_UnixClientOpts PSC_UnixClientOpts;
 typedef struct PSC_TcpClientOpts PSC_TcpClientOpts;
+typedef struct Stats Stats;
 
-TcpClient *TcpClient_create(PSC_TcpClientOpts *opts, PSC_Server *sockserver,
-	PSC_UnixClientOpts *sockopts);
+/* Keeps config->tunnels TCP connections to the remote hosts given by opts,
+ * preferring hosts that are up and have the fewest connections, then the
+ * shortest round-trip time. Takes ownership of opts[0] to opts[nopts-1],
+ * which must match config->remotehost, and of stats. */
+TcpClient *TcpClient_create(PSC_TcpClientOpts **opts, int nopts,
+	PSC_Server *sockserver, PSC_UnixClientOpts *sockopts, Stats *stats,
+	const Config *config);
 void TcpClient_destroy(TcpClient *self);
 
 #endif
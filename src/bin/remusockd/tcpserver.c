@@ -1,5 +1,10 @@
+#include "bonds.h"
+#include "config.h"
 #include "protocol.h"
+#include "sessions.h"
+#include "stats.h"
 #include "tcpserver.h"
+#include "tunnels.h"
 
 #include <poser/core.h>
 #include <stdlib.h>
@@ -7,8 +12,13 @@
 struct TcpServer
 {
     PSC_Server *tcpserver;
-    PSC_Server *sockserver;
+    Tunnels *tunnels;
+    Sessions *sessions;
+    Bonds *bonds;
+    Stats *stats;
     PSC_UnixClientOpts *sockopts;
+    const Config *config;
+    int clients;
 };
 
 typedef struct ClientRec
@@ -16,6 +26,8 @@ typedef struct ClientRec
     TcpServer *server;
     PSC_Connection *client;
     int identticks;
+    size_t identlen;
+    uint8_t ident[2];
 } ClientRec;
 
 static void identtimeout(void *receiver, void *sender, void *args);
@@ -53,7 +65,7 @@ static void identabort(void *receiver, void *sender, void *args)
 
 static void deleteproto(void *proto)
 {
-    Protocol_destroy(proto);
+    Protocol_detach(proto);
 }
 
 static void identcheck(void *receiver, void *sender, void *args)
@@ -62,18 +74,27 @@ static void identcheck(void *receiver, void *sender, void *args)
     PSC_Connection *client = sender;
     PSC_EADataReceived *dra = args;
 
+    /* the client may send frames right after its identification */
+    const uint8_t *buf = PSC_EADataReceived_buf(dra);
+    size_t sz = PSC_EADataReceived_size(dra);
+    while (sz && cr->identlen < sizeof cr->ident)
+    {
+	cr->ident[cr->identlen++] = *buf++;
+	--sz;
+    }
+    if (cr->identlen < sizeof cr->ident) return;
+
     PSC_Event_unregister(PSC_Service_tick(), cr, identtimeout, 0);
     PSC_Event_unregister(PSC_Connection_dataReceived(client), cr,
 	    identcheck, 0);
     PSC_Event_unregister(PSC_Connection_closed(client), cr, identabort, 0);
 
-    const uint8_t *buf = PSC_EADataReceived_buf(dra);
-    if (buf[0] != CMD_IDENT) goto protoerr;
+    if (cr->ident[0] != CMD_IDENT) goto protoerr;
 
-    switch (buf[1])
+    switch (cr->ident[1])
     {
 	case ARG_SERVER:
-	    if (cr->server->sockserver)
+	    if (cr->server->tunnels)
 	    {
 		PSC_Log_fmt(PSC_L_WARNING, "TcpServer: client from %s "
 			"identified as socket server, expected socket client",
@@ -83,7 +104,7 @@ static void identcheck(void *receiver, void *sender, void *args)
 	    break;
 
 	case ARG_CLIENT:
-	    if (!cr->server->sockserver)
+	    if (!cr->server->tunnels)
 	    {
 		PSC_Log_fmt(PSC_L_WARNING, "TcpServer: client from %s "
 			"identified as socket client, expected socket server",
@@ -97,8 +118,11 @@ static void identcheck(void *receiver, void *sender, void *args)
     }
 
     Protocol *proto = Protocol_create(client,
-	    cr->server->sockserver, cr->server->sockopts);
+	    cr->server->tunnels, cr->server->sockopts,
+	    cr->server->sessions, cr->server->bonds, cr->server->stats,
+	    cr->server->config, 0);
     PSC_Connection_setData(client, proto, deleteproto);
+    if (sz) Protocol_receive(proto, buf, sz);
     return;
 
 protoerr:
@@ -119,7 +143,6 @@ static void identsent(void *receiver, void *sender, void *args)
     PSC_Event_register(PSC_Connection_dataReceived(client), cr, identcheck, 0);
     PSC_Event_unregister(PSC_Connection_dataSent(client), cr, identsent, 0);
 
-    PSC_Connection_receiveBinary(client, 2);
     PSC_Connection_resume(client);
 }
 
@@ -130,9 +153,12 @@ static void clientConnected(void *receiver, void *sender, void *args)
     PSC_Connection *client = args;
 
     const uint8_t *idmsg;
-    if (self->sockserver)
+    if (self->tunnels)
     {
-	PSC_Server_disable(server);
+	if (++self->clients >= self->config->tunnels)
+	{
+	    PSC_Server_disable(server);
+	}
 	idmsg = idsrv;
     }
     else
@@ -144,6 +170,7 @@ static void clientConnected(void *receiver, void *sender, void *args)
     cr->server = self;
     cr->client = client;
     cr->identticks = IDENTTICKS;
+    cr->identlen = 0;
     PSC_Connection_setData(client, cr, free);
 
     PSC_Event_register(PSC_Connection_closed(client), cr, identabort, 0);
@@ -155,14 +182,16 @@ static void clientConnected(void *receiver, void *sender, void *args)
 
 static void clientDisconnected(void *receiver, void *sender, void *args)
 {
-    (void)receiver;
     (void)args;
 
+    TcpServer *self = receiver;
+
+    --self->clients;
     PSC_Server_enable(sender);
 }
 
 TcpServer *TcpServer_create(PSC_TcpServerOpts *opts, PSC_Server *sockserver,
-	PSC_UnixClientOpts *sockopts)
+	PSC_UnixClientOpts *sockopts, Stats *stats, const Config *config)
 {
     PSC_Server *tcpserver = PSC_Server_createTcp(opts);
     PSC_TcpServerOpts_destroy(opts);
@@ -171,13 +200,18 @@ TcpServer *TcpServer_create(PSC_TcpServerOpts *opts, PSC_Server *sockserver,
 
     TcpServer *self = PSC_malloc(sizeof *self);
     self->tcpserver = tcpserver;
-    self->sockserver = sockserver;
+    self->tunnels = sockserver ? Tunnels_create(sockserver) : 0;
+    self->sessions = Sessions_create();
+    self->bonds = Bonds_create();
+    self->stats = stats;
     self->sockopts = sockopts;
+    self->config = config;
+    self->clients = 0;
 
     PSC_Event_register(PSC_Server_clientConnected(tcpserver),
 	    self, clientConnected, 0);
 
-    if (sockserver)
+    if (self->tunnels)
     {
 	PSC_Event_register(PSC_Server_clientDisconnected(tcpserver),
 		self, clientDisconnected, 0);
@@ -189,7 +223,7 @@ TcpServer *TcpServer_create(PSC_TcpServerOpts *opts, PSC_Server *sockserver,
 void TcpServer_destroy(TcpServer *self)
 {
     if (!self) return;
-    if (self->sockserver)
+    if (self->tunnels)
     {
 	PSC_Event_unregister(PSC_Server_clientDisconnected(self->tcpserver),
 		self, clientDisconnected, 0);
@@ -197,7 +231,10 @@ void TcpServer_destroy(TcpServer *self)
     PSC_Event_unregister(PSC_Server_clientConnected(self->tcpserver),
 	    self, clientConnected, 0);
     PSC_Server_destroy(self->tcpserver);
-    PSC_Server_destroy(self->sockserver);
+    Sessions_destroy(self->sessions);
+    Bonds_destroy(self->bonds);
+    Tunnels_destroy(self->tunnels);
+    Stats_destroy(self->stats);
     PSC_UnixClientOpts_destroy(self->sockopts);
     free(self);
 }
@@ -3,12 +3,14 @@
 
 typedef struct TcpServer TcpServer;
 
+typedef struct Config Config;
 typedef struct PSC_Server PSC_Server;
 typedef struct PSC_UnixClientOpts PSC_UnixClientOpts;
 typedef struct PSC_TcpServerOpts PSC_TcpServerOpts;
+typedef struct Stats Stats;
 
 TcpServer *TcpServer_create(PSC_TcpServerOpts *opts, PSC_Server *sockserver,
-	PSC_UnixClientOpts *sockopts);
+	PSC_UnixClientOpts *sockopts, Stats *stats, const Config *config);
 void TcpServer_destroy(TcpServer *self);
 
 #endif
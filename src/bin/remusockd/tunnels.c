@@ -0,0 +1,90 @@
+#include "protocol.h"
+#include "tunnels.h"
+
+#include <poser/core.h>
+#include <stdlib.h>
+
+struct Tunnels
+{
+    PSC_Server *sockserver;
+    Protocol **protos;
+    size_t size;
+    size_t count;
+};
+
+static void newclient(void *receiver, void *sender, void *args);
+
+static void newclient(void *receiver, void *sender, void *args)
+{
+    (void)sender;
+
+    Tunnels *self = receiver;
+    PSC_Connection *sockconn = args;
+
+    Protocol *best = 0;
+    size_t bestload = 0;
+    for (size_t i = 0; i < self->count; ++i)
+    {
+	size_t load = Protocol_load(self->protos[i]);
+	if (!best || load < bestload)
+	{
+	    best = self->protos[i];
+	    bestload = load;
+	}
+    }
+
+    if (!best || Protocol_accept(best, sockconn) < 0)
+    {
+	PSC_Log_msg(PSC_L_WARNING,
+		"Tunnels: error accepting socket connection");
+	PSC_Connection_close(sockconn, 0);
+    }
+}
+
+Tunnels *Tunnels_create(PSC_Server *sockserver)
+{
+    Tunnels *self = PSC_malloc(sizeof *self);
+    self->sockserver = sockserver;
+    self->protos = 0;
+    self->size = 0;
+    self->count = 0;
+    PSC_Server_disable(sockserver);
+    PSC_Event_register(PSC_Server_clientConnected(sockserver), self,
+	    newclient, 0);
+    return self;
+}
+
+void Tunnels_add(Tunnels *self, Protocol *proto)
+{
+    if (self->count == self->size)
+    {
+	self->size = self->size ? 2 * self->size : 4;
+	self->protos = PSC_realloc(self->protos,
+		self->size * sizeof *self->protos);
+    }
+    self->protos[self->count++] = proto;
+    if (self->count == 1) PSC_Server_enable(self->sockserver);
+}
+
+void Tunnels_remove(Tunnels *self, Protocol *proto)
+{
+    for (size_t i = 0; i < self->count; ++i)
+    {
+	if (self->protos[i] == proto)
+	{
+	    self->protos[i] = self->protos[--self->count];
+	    if (!self->count) PSC_Server_disable(self->sockserver);
+	    return;
+	}
+    }
+}
+
+void Tunnels_destroy(Tunnels *self)
+{
+    if (!self) return;
+    PSC_Event_unregister(PSC_Server_clientConnected(self->sockserver), self,
+	    newclient, 0);
+    PSC_Server_destroy(self->sockserver);
+    free(self->protos);
+    free(self);
+}
@@ -0,0 +1,19 @@
+#ifndef REMUSOCKD_TUNNELS_H
+#define REMUSOCKD_TUNNELS_H
+
+#include <stddef.h>
+
+typedef struct Tunnels Tunnels;
+
+typedef struct Protocol Protocol;
+typedef struct PSC_Server PSC_Server;
+
+/* Dispatches connections accepted on the socket server to the least loaded
+ * of all registered tunnels. The socket server is only enabled while at
+ * least one tunnel is registered, and destroyed together with this. */
+Tunnels *Tunnels_create(PSC_Server *sockserver);
+void Tunnels_add(Tunnels *self, Protocol *proto);
+void Tunnels_remove(Tunnels *self, Protocol *proto);
+void Tunnels_destroy(Tunnels *self);
+
+#endif